@@ -0,0 +1,65 @@
+#ifndef __CONC_LIMIT_H__
+#define __CONC_LIMIT_H__
+
+/* Adaptive concurrency limit (gradient style) driven by the measured
+ * round trip of calls to a shared resource, e.g. the database. The
+ * average round trip of a window of calls is compared to the lowest one
+ * seen recently, taken as the round trip without queueing: while they
+ * match the limit grows, once calls start waiting on each other the
+ * limit shrinks in proportion.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct conc_limit;
+typedef struct conc_limit conc_limit_t;
+
+typedef struct {
+	int		min_limit;
+	int		max_limit;
+	int		initial_limit;
+	int		window;		// samples averaged per update
+	double		smoothing;	// weight of a new estimate (0..1]
+	double		tolerance;	// round trip over the no load one accepted
+					// before the limit is lowered
+} conc_limit_attr_t;
+
+typedef struct {
+	int			limit;
+	int			inflight;
+	unsigned long long	rtt_us;		// average of the last window
+	unsigned long long	rtt_noload_us;	// lowest window average recently
+} conc_limit_stats_t;
+
+
+void conc_limit_attr_init(conc_limit_attr_t *attr);
+
+conc_limit_t * conc_limit_create(const conc_limit_attr_t *attr);
+
+void conc_limit_destroy(conc_limit_t *cl);
+
+/* a call starts, returns its start time for conc_limit_end */
+uint64_t conc_limit_start(conc_limit_t *cl);
+
+/* the call started at start completed, returns 1 if the limit changed */
+int conc_limit_end(conc_limit_t *cl, const uint64_t start);
+
+/* Concurrency of the user of the limit, e.g. the running jobs of a stage,
+ * when its calls are serialized and the calls in flight do not show it.
+ * A window is taken as using the limit if either reaches half of it.
+ */
+void conc_limit_busy(conc_limit_t *cl, const int busy);
+
+int conc_limit_get(conc_limit_t *cl);
+
+void conc_limit_get_stats(conc_limit_t *cl, conc_limit_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CONC_LIMIT_H__
@@ -4,16 +4,35 @@
 #include <stdint.h>
 #include <string.h>
 
-#define GATEWAY_PROTOCOL_PACKET_SIZE_MAX    	128
+#define GATEWAY_PROTOCOL_PACKET_SIZE_MAX    	0xFFF0	// a whole number of AES blocks
 #define GATEWAY_PROTOCOL_APPKEY_SIZE		8
 #define GATEWAY_PROTOCOL_SECURE_KEY_SIZE	16
 
+/* The header is the app key, the dev id, the packet type and the payload
+ * length. The length is one byte, unless the type has the varint flag:
+ * it is then LEB128 (7 bits a byte from the lowest, the high bit set on
+ * all bytes but the last) of up to 3 bytes. Packets with a payload of up
+ * to 255 bytes are encoded with the one byte length, as they always were.
+ */
+#define GATEWAY_PROTOCOL_PACKET_TYPE_VARINT	0x80
+#define GATEWAY_PROTOCOL_VARINT_SIZE_MAX	3
+#define GATEWAY_PROTOCOL_PAYLOAD_SIZE_LEGACY	0xFF
+
+/* bytes a packet takes besides its payload, padding included */
+#define GATEWAY_PROTOCOL_PACKET_OVERHEAD_MAX	(GATEWAY_PROTOCOL_APPKEY_SIZE + 2 + \
+						 GATEWAY_PROTOCOL_VARINT_SIZE_MAX + GATEWAY_PROTOCOL_SECURE_KEY_SIZE - 1)
+
+/* a DATA_SEND_MULTI payload is records back to back, each of an utc
+ * (4 bytes, as in DATA_SEND), a data length (1 byte) and the data */
+#define GATEWAY_PROTOCOL_DATA_RECORD_HEADER_SIZE	5
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef enum {
     GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND = 0x00,
+    GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND_MULTI = 0x01,
     GATEWAY_PROTOCOL_PACKET_TYPE_PEND_REQ = 0x04,
     GATEWAY_PROTOCOL_PACKET_TYPE_PEND_SEND = 0x05,
     GATEWAY_PROTOCOL_PACKET_TYPE_STAT = 0x10,
@@ -37,23 +56,49 @@ typedef struct {
 
 typedef uint8_t (* gateway_protocol_checkup_callback_t)(gateway_protocol_conf_t *);
 
+/* a decoded packet, the payload is left in the packet buffer */
+typedef struct {
+	gateway_protocol_packet_type_t packet_type;
+	const uint8_t *payload;
+	uint16_t payload_length;
+} gateway_protocol_packet_view_t;
+
 
+/* packet has room for payload_length + GATEWAY_PROTOCOL_PACKET_OVERHEAD_MAX,
+ * which is at most GATEWAY_PROTOCOL_PACKET_SIZE_MAX */
 void gateway_protocol_packet_encode (
     const gateway_protocol_conf_t *gwp_conf,
     const gateway_protocol_packet_type_t packet_type,
-    const uint8_t payload_length,
+    const uint16_t payload_length,
     const uint8_t *payload,
-    uint8_t *packet_length,
+    uint16_t *packet_length,
     uint8_t *packet);
 
-uint8_t gateway_protocol_packet_decode (
+uint16_t gateway_protocol_packet_decode (
     gateway_protocol_conf_t *gwp_conf,
     gateway_protocol_packet_type_t *packet_type,
-    uint8_t *payload_length,
+    uint16_t *payload_length,
     uint8_t *payload,
-    uint8_t packet_length,
+    uint16_t packet_length,
     uint8_t *packet);
 
+/* decodes packet in place, decrypted if secure, the view points into it
+ * and is valid as long as the packet is; returns the frame length, 0 if
+ * the packet is malformed */
+uint16_t gateway_protocol_packet_view (
+    gateway_protocol_conf_t *gwp_conf,
+    gateway_protocol_packet_view_t *view,
+    uint16_t packet_length,
+    uint8_t *packet);
+
+/* the length of a frame from the header fields that follow the app key,
+ * decrypted if secure; 0 if header_length is too short to tell, -1 if
+ * the length is malformed */
+int32_t gateway_protocol_packet_length (
+    const uint8_t *header,
+    const uint16_t header_length,
+    const uint8_t secure);
+
 void gateway_protocol_set_checkup_callback(gateway_protocol_checkup_callback_t callback);
 
 #ifdef __cplusplus
@@ -0,0 +1,50 @@
+#ifndef __IO_RING_H__
+#define __IO_RING_H__
+
+/* io_uring through its kernel interface, for an event loop thread. The
+ * operations are queued and submitted together by the next io_ring_wait,
+ * which also collects the completions, so that a round of the loop costs
+ * one system call whatever it did.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct io_ring;
+typedef struct io_ring io_ring_t;
+
+typedef struct {
+	uint64_t	data;		// of the operation
+	int		res;		// as the system call would return, -errno on error
+	uint8_t		more;		// a multishot operation stays armed
+} io_ring_event_t;
+
+
+/* NULL if the kernel has no io_uring or lacks an operation used here */
+io_ring_t * io_ring_create(const unsigned int entries);
+
+/* operations not completed yet are cancelled by the kernel */
+void io_ring_destroy(io_ring_t *ir);
+
+/* nonblocking descriptors, multishot until a completion without more */
+int io_ring_accept(io_ring_t *ir, int desc, const uint8_t multishot, uint64_t data);
+
+int io_ring_recv(io_ring_t *ir, int desc, void *buf, const unsigned int len, uint64_t data);
+
+int io_ring_read(io_ring_t *ir, int desc, void *buf, const unsigned int len, uint64_t data);
+
+/* the operation of data completes with -ECANCELED if it had not yet */
+int io_ring_cancel(io_ring_t *ir, uint64_t data);
+
+/* submits the queued operations and waits up to timeout_ms (-1 forever)
+ * for completions, returns their number or -1 with errno set */
+int io_ring_wait(io_ring_t *ir, io_ring_event_t *events, const int events_max, const int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __IO_RING_H__
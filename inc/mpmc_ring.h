@@ -0,0 +1,33 @@
+#ifndef __MPMC_RING_H__
+#define __MPMC_RING_H__
+
+/* Bounded lock-free multi-producer multi-consumer ring of pointers.
+ * Each slot carries a sequence number (D. Vyukov's scheme) and
+ * producer/consumer cursors live on separate cache lines.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mpmc_ring;
+typedef struct mpmc_ring mpmc_ring_t;
+
+/* capacity is rounded up to the next power of two */
+mpmc_ring_t * mpmc_ring_create(const unsigned int capacity);
+
+void mpmc_ring_destroy(mpmc_ring_t *r);
+
+/* returns 1 on success, 0 if the ring is full */
+int mpmc_ring_push(mpmc_ring_t *r, void *data);
+
+/* returns 1 on success, 0 if the ring is empty */
+int mpmc_ring_pop(mpmc_ring_t *r, void **data);
+
+unsigned int mpmc_ring_get_capacity(const mpmc_ring_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MPMC_RING_H__
@@ -0,0 +1,40 @@
+#ifndef __OBJ_POOL_H__
+#define __OBJ_POOL_H__
+
+/* Pool of fixed-size objects carved from slabs and recycled through
+ * per-thread magazines. A thread allocates and frees from its own
+ * magazine and only takes the pool lock to swap a full or an empty
+ * magazine, so objects allocated on one thread and freed on another
+ * flow back without going through malloc. Slabs are released when
+ * the pool is destroyed.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct obj_pool;
+typedef struct obj_pool obj_pool_t;
+
+/* magazine_size objects are cached per thread, 0 picks a default */
+obj_pool_t * obj_pool_create(const size_t obj_size, const unsigned int magazine_size);
+
+/* every object must have been returned and the threads using the pool
+ * must not touch it anymore */
+void obj_pool_destroy(obj_pool_t *pool);
+
+/* returns NULL when out of memory, the object is not zeroed */
+void * obj_pool_alloc(obj_pool_t *pool);
+
+void obj_pool_free(obj_pool_t *pool, void *obj);
+
+/* objects carved from slabs so far */
+size_t obj_pool_get_capacity(const obj_pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __OBJ_POOL_H__
@@ -0,0 +1,72 @@
+#ifndef __TASK_PIPELINE_H__
+#define __TASK_PIPELINE_H__
+
+/* Staged (SEDA style) processing on top of task_queue. Every stage is
+ * served by its own queue and worker pool, sized for what the stage
+ * waits on, and hands the job argument to another stage when done.
+ */
+
+#include "task_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct task_pipeline;
+typedef struct task_pipeline task_pipeline_t;
+
+#define TASK_STAGE_DONE		(-1)	// the stage is the last one to use arg
+#define TASK_STAGE_NEXT		(-2)	// arg goes to the following stage
+
+/* returns TASK_STAGE_DONE, TASK_STAGE_NEXT or the index of the stage
+ * to hand arg to, jattr may be changed for that stage */
+typedef int (*task_stage_func_t)(void *arg, task_job_attr_t *jattr);
+
+/* last stage consuming count arguments at once */
+typedef void (*task_stage_batch_func_t)(void **args, int count);
+
+/* called with the argument of a job shed or expired in a stage queue,
+ * or refused by the stage it was handed to */
+typedef void (*task_pipeline_drop_func_t)(void *arg, int stage);
+
+typedef struct {
+	const char		*name;
+	task_stage_func_t	func;
+	task_stage_batch_func_t	batch_func;	// set instead of func for batching stages
+	task_queue_attr_t	queue_attr;	// drop_func is replaced by the pipeline one
+	int			queue_stage;	// index of an earlier stage whose queue is
+						// shared, -1 for a queue of its own
+} task_stage_attr_t;
+
+
+void task_stage_attr_init(task_stage_attr_t *attr);
+
+task_pipeline_t * task_pipeline_create(const task_stage_attr_t *stages, const int stages_num,
+				       task_pipeline_drop_func_t drop_func);
+
+/* stages are shut down in order, jobs handed on by running ones still
+ * reach the following stages */
+void task_pipeline_destroy(task_pipeline_t *pl);
+
+/* enters the first stage, same return values as task_queue_enqueue */
+int task_pipeline_submit(task_pipeline_t *pl, void *arg, const task_job_attr_t *jattr);
+
+int task_pipeline_submit_at(task_pipeline_t *pl, const int stage, void *arg, const task_job_attr_t *jattr);
+
+/* enters a non batching stage after delay_ms, a job its queue refuses
+ * then goes to the drop function */
+int task_pipeline_submit_delayed(task_pipeline_t *pl, const int stage, void *arg, const task_job_attr_t *jattr,
+				 const unsigned int delay_ms);
+
+int task_pipeline_get_stages_num(const task_pipeline_t *pl);
+
+const char * task_pipeline_get_stage_name(const task_pipeline_t *pl, const int stage);
+
+/* the queue serving a stage, for stats and metrics */
+task_queue_t * task_pipeline_get_queue(const task_pipeline_t *pl, const int stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TASK_PIPELINE_H__
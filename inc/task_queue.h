@@ -1,29 +1,238 @@
 #ifndef __TASK_QUEUE_H__
 #define __TASK_QUEUE_H__
 
-/* Task queue that create threads for completing tasks
- * having an upper threads limit 
+/* Task queue served by a fixed pool of worker threads.
+ * The pool is spawned on creation and workers sleep while
+ * the queue is empty.
  */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct task_queue;
 typedef struct task_queue task_queue_t;
 
 typedef void (*task_func_t)(void *arg);
 
+/* consumes count arguments of batchable jobs at once */
+typedef void (*task_batch_func_t)(void **args, int count);
 
+/* called with the job arguments of shed or discarded jobs */
+typedef void (*task_drop_func_t)(task_func_t task, void *arg);
+
+/* completion handle of a job queued with task_queue_enqueue_future */
+struct task_future;
+typedef struct task_future task_future_t;
+
+/* a job whose return value completes its future */
+typedef void * (*task_future_func_t)(void *arg);
+
+/* continuation, runs once the future is complete */
+typedef void (*task_future_then_t)(task_future_t *fut, void *arg);
+
+#define TASK_QUEUE_ERR		(-1)
+#define TASK_QUEUE_ERR_FULL	(-2)	// job rejected, the caller keeps arg
+
+typedef enum {
+	TASK_FUTURE_PENDING = 0,
+	TASK_FUTURE_DONE,		// the job ran, the result is its return value
+	TASK_FUTURE_DROPPED		// shed, expired or discarded by destroy
+} task_future_state_t;
+
+typedef enum {
+	TASK_QUEUE_BACKEND_LIST = 0,	// unbounded linked list guarded by a mutex
+	TASK_QUEUE_BACKEND_RING,	// bounded lock-free MPMC ring
+	TASK_QUEUE_BACKEND_STEAL	// per-worker Chase-Lev deques with work stealing
+} task_queue_backend_t;
+
+/* priority lanes, every lane has its own store */
+typedef enum {
+	TASK_QUEUE_PRIO_HIGH = 0,	// latency sensitive control jobs
+	TASK_QUEUE_PRIO_NORMAL,
+	TASK_QUEUE_PRIO_LOW,		// bulk jobs
+	TASK_QUEUE_PRIO_NUM
+} task_queue_prio_t;
+
+typedef enum {
+	TASK_QUEUE_SCHED_STRICT = 0,	// a lane is served only while higher ones are empty
+	TASK_QUEUE_SCHED_WEIGHTED	// non-empty lanes share workers by their weights
+} task_queue_sched_t;
+
+/* what enqueue does when the queue is full */
+typedef enum {
+	TASK_QUEUE_OVERFLOW_REJECT = 0,	// the new job is refused with TASK_QUEUE_ERR_FULL
+	TASK_QUEUE_OVERFLOW_DROP_OLDEST,// the oldest job of the lowest lane not above the
+					// new job's one is handed to drop_func, with
+					// TASK_QUEUE_BACKEND_STEAL the oldest not yet taken
+					// up by a worker, else the newest a worker holds
+	TASK_QUEUE_OVERFLOW_BLOCK	// the producer waits for room
+} task_queue_overflow_t;
+
+typedef struct {
+	int 			max_threads;	// number of pool workers
+	task_queue_backend_t	backend;
+	int			capacity;	// ring slots per lane, rounded up to a power of two
+	task_queue_sched_t	sched;
+	int			weights[TASK_QUEUE_PRIO_NUM]; // TASK_QUEUE_SCHED_WEIGHTED shares
+	int			max_size;	// pending jobs limit, 0 - bounded by the store only
+	task_queue_overflow_t	overflow;	// see task_queue_overflow_t, DROP_OLDEST is
+						// approximate with TASK_QUEUE_BACKEND_STEAL
+	task_drop_func_t	drop_func;	// may be NULL
+	int			batch_max;	// arguments handed to a task_batch_func_t at most
+	long			batch_wait_us;	// time a worker waits for a batch to fill
+	unsigned int		timer_tick_ms;	// resolution of delayed jobs
+} task_queue_attr_t;
+
+typedef struct {
+	int			size;		// pending and running jobs
+	int			pending;
+	int			active_tasks;
+	unsigned long long	rejected;	// TASK_QUEUE_ERR_FULL returned to a producer
+	unsigned long long	dropped;	// accepted, delayed ones included, then
+						// discarded and handed to drop_func if set
+	unsigned long long	blocked;	// producers that had to wait for room
+	int			delayed;	// waiting for their delay to elapse
+	unsigned long long	expired;	// taken past their deadline, handed to
+						// drop_func without running
+} task_queue_stats_t;
+
+#define TASK_QUEUE_HIST_BUCKETS	24
+
+/* log2 histogram of durations, bucket 0 counts those under 1 us,
+ * bucket i those in [2^(i-1), 2^i) us and the last one everything above */
+typedef struct {
+	unsigned long long	count;
+	unsigned long long	sum_us;
+	unsigned long long	max_us;
+	unsigned long long	buckets[TASK_QUEUE_HIST_BUCKETS];
+} task_queue_hist_t;
+
+/* cumulative since creation */
+typedef struct {
+	task_queue_hist_t	wait;		// enqueue to dequeue of every job run
+	task_queue_hist_t	service;	// run time, a batch counts as one run
+	int			size_hwm;	// pending and running jobs high-water mark
+	int			pending_hwm;
+	int			lane_pending_hwm[TASK_QUEUE_PRIO_NUM];
+	int			active_workers;	// workers running a job now
+	int			active_workers_hwm;
+	int			workers;
+	int			limit;		// workers allowed to run jobs
+} task_queue_metrics_t;
+
+#define TASK_JOB_HINT_NONE	(-1)
+#define TASK_JOB_KEY_NONE	(-1L)
+#define TASK_JOB_FLOW_NONE	(-1L)
+
+/* per job submission options */
+typedef struct {
+	int			hint;		// worker affinity (e.g. a device hash) for
+						// TASK_QUEUE_BACKEND_STEAL, TASK_JOB_HINT_NONE
+						// dispatches round robin
+	task_queue_prio_t	prio;		// TASK_QUEUE_PRIO_NORMAL by default
+	long			key;		// jobs sharing a key (e.g. a device) run one
+						// at a time in submission order, different
+						// keys in parallel, TASK_JOB_KEY_NONE by default
+	long			flow;		// flows (e.g. tenants) share each lane by
+						// deficit round robin in proportion to their
+						// weights, TASK_JOB_FLOW_NONE by default
+	unsigned long long	deadline_ns;	// task_queue_now_ns() after which the job
+						// is not worth running, 0 for none
+} task_job_attr_t;
+
+
+void task_queue_attr_init(task_queue_attr_t *attr);
+
+void task_job_attr_init(task_job_attr_t *jattr);
+
+/* max_threads - number of pool workers (at least one) */
 task_queue_t * task_queue_create(const int max_threads);
 
+task_queue_t * task_queue_create_attr(const task_queue_attr_t *attr);
+
 void task_queue_destroy(task_queue_t *tq);
 
+/* returns the number of running jobs, TASK_QUEUE_ERR_FULL when the job
+ * is refused by the overflow policy or TASK_QUEUE_ERR on error */
 int task_queue_enqueue(task_queue_t *tq, task_func_t task, void *arg);
 
+/* jattr may be NULL */
+int task_queue_enqueue_attr(task_queue_t *tq, task_func_t task, void *arg, const task_job_attr_t *jattr);
+
+/* Queues a job that a worker may run together with the following jobs
+ * of the same lane sharing the batch function, up to batch_max of them.
+ * drop_func receives a NULL task for batchable jobs.
+ */
+int task_queue_enqueue_batchable(task_queue_t *tq, task_batch_func_t batch, void *arg, const task_job_attr_t *jattr);
+
+/* Queues the job once delay_ms have elapsed, timed by a hierarchical
+ * timer wheel instead of a sleeping worker. The overflow policy applies
+ * at that time, a refused job is handed to drop_func.
+ * Returns 0 or TASK_QUEUE_ERR.
+ */
+int task_queue_enqueue_delayed(task_queue_t *tq, task_func_t task, void *arg, const task_job_attr_t *jattr,
+			       const unsigned int delay_ms);
+
+/* Queues a job and returns its completion handle or NULL if the job was
+ * refused. The handle holds a reference released by task_future_release,
+ * the queue holds another one until the future is complete. drop_func is
+ * not called for such jobs, their future completes as dropped instead.
+ */
+task_future_t * task_queue_enqueue_future(task_queue_t *tq, task_future_func_t task, void *arg,
+					  const task_job_attr_t *jattr);
+
+/* the state without blocking */
+task_future_state_t task_future_poll(task_future_t *fut);
+
+/* blocks until the future is complete, timeout_ms < 0 waits for ever,
+ * returns TASK_FUTURE_PENDING on timeout */
+task_future_state_t task_future_wait(task_future_t *fut, const int timeout_ms);
+
+/* return value of the job once done, NULL otherwise */
+void * task_future_get_result(task_future_t *fut);
+
+/* Registers the continuation of a future, one at most. It runs on the
+ * thread completing the future, a worker or the dropping thread, or
+ * right away on the caller if the future is already complete. The
+ * future stays valid during the call. Returns 0 or TASK_QUEUE_ERR.
+ */
+int task_future_then(task_future_t *fut, task_future_then_t then, void *arg);
+
+void task_future_release(task_future_t *fut);
+
 void task_queue_suspend(task_queue_t *tq);
 
 void task_queue_unsuspend(task_queue_t *tq);
 
+/* Lets only the first limit workers (1..max_threads) take jobs, the others
+ * stay parked, e.g. for an adaptive concurrency limit. Running jobs are
+ * not interrupted when the limit is lowered.
+ */
+void task_queue_set_limit(task_queue_t *tq, const int limit);
+
+/* share of a flow (1 by default) relative to the other flows of a lane,
+ * a flow lives as long as the queue once it has been used or weighted */
+int task_queue_set_flow_weight(task_queue_t *tq, const long flow, const int weight);
+
+int task_queue_get_limit(task_queue_t *tq);
+
 int task_queue_get_size(task_queue_t *tq);
 
 int task_queue_is_empty(task_queue_t *tq);
 
+void task_queue_get_stats(task_queue_t *tq, task_queue_stats_t *stats);
+
+void task_queue_get_metrics(task_queue_t *tq, task_queue_metrics_t *metrics);
+
+/* monotonic clock of job deadlines */
+unsigned long long task_queue_now_ns(void);
+
+/* upper bound in us of the bucket holding the q quantile (0 < q <= 1) */
+unsigned long long task_queue_hist_percentile(const task_queue_hist_t *hist, const double q);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // __TASK_QUEUE_H__
@@ -0,0 +1,52 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+/* Hierarchical timing wheel (Varghese & Lauck) driven by its own thread.
+ * Four levels of 64 slots, timers far in the future sit in coarse slots
+ * and cascade down as their time gets closer, so adding, cancelling and
+ * expiring a timer cost O(1). Entries are provided by the caller.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct timer_wheel;
+typedef struct timer_wheel timer_wheel_t;
+
+typedef void (*timer_func_t)(void *arg);
+
+typedef struct timer_entry {
+	struct timer_entry	*next;
+	struct timer_entry	*prev;
+	struct timer_entry	**slot;		// NULL while not armed
+	uint64_t		expires;	// in ticks
+	timer_func_t		func;
+	void			*arg;
+} timer_entry_t;
+
+void timer_entry_init(timer_entry_t *te, timer_func_t func, void *arg);
+
+/* tick_ms - resolution of the wheel */
+timer_wheel_t * timer_wheel_create(const unsigned int tick_ms);
+
+/* armed entries are handed to discard_func (may be NULL) instead of firing */
+void timer_wheel_destroy(timer_wheel_t *tw, timer_func_t discard_func);
+
+/* func runs on the wheel thread after delay_ms (rounded up to a tick),
+ * returns 0 if te is already armed */
+int timer_wheel_add(timer_wheel_t *tw, timer_entry_t *te, const unsigned int delay_ms);
+
+/* returns 1 if te was disarmed, 0 if it has fired or was not armed */
+int timer_wheel_cancel(timer_wheel_t *tw, timer_entry_t *te);
+
+/* armed entries */
+int timer_wheel_get_size(timer_wheel_t *tw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TIMER_WHEEL_H__
@@ -0,0 +1,39 @@
+#ifndef __WS_DEQUE_H__
+#define __WS_DEQUE_H__
+
+/* Chase-Lev work-stealing deque of pointers.
+ * Only the owner thread may push and pop (bottom end),
+ * any thread may steal (top end). The array grows on demand,
+ * retired arrays are released on destroy.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ws_deque;
+typedef struct ws_deque ws_deque_t;
+
+#define WS_DEQUE_EMPTY		0
+#define WS_DEQUE_OK		1
+#define WS_DEQUE_ABORT		-1	// lost a race with another thief, retry
+
+/* capacity is rounded up to the next power of two */
+ws_deque_t * ws_deque_create(const unsigned int capacity);
+
+void ws_deque_destroy(ws_deque_t *d);
+
+/* owner only, returns 0 on allocation failure */
+int ws_deque_push(ws_deque_t *d, void *data);
+
+/* owner only, returns WS_DEQUE_OK or WS_DEQUE_EMPTY */
+int ws_deque_pop(ws_deque_t *d, void **data);
+
+/* any thread, returns WS_DEQUE_OK, WS_DEQUE_EMPTY or WS_DEQUE_ABORT */
+int ws_deque_steal(ws_deque_t *d, void **data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __WS_DEQUE_H__
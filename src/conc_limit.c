@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "conc_limit.h"
+
+#define CONC_LIMIT_WINDOW_DEFAULT	32
+#define CONC_LIMIT_BASELINE_WINDOWS	64	// windows the no load round trip is kept for
+
+struct conc_limit {
+	double		min_limit;
+	double		max_limit;
+	double		smoothing;
+	double		tolerance;
+	int		window;
+
+	pthread_mutex_t	mutex;
+	double		estimate;
+	int		limit;		// estimate rounded
+	int		inflight;
+	int		inflight_max;	// highest in the window
+	int		busy_max;	// highest reported in the window
+	int		samples;
+	uint64_t	sum_ns;
+	double		rtt_ns;
+	double		rtt_min_ns[2];	// previous and current baseline periods
+	int		windows;	// of the current period
+};
+
+static uint64_t conc_limit_now_ns(void);
+static double conc_limit_baseline(const conc_limit_t *cl);
+static int conc_limit_update(conc_limit_t *cl);
+
+
+void conc_limit_attr_init(conc_limit_attr_t *attr) {
+	if (!attr) {
+		return;
+	}
+	attr->min_limit		= 1;
+	attr->max_limit		= 1;
+	attr->initial_limit	= 1;
+	attr->window		= CONC_LIMIT_WINDOW_DEFAULT;
+	attr->smoothing		= 0.2;
+	attr->tolerance		= 1.5;
+}
+
+conc_limit_t * conc_limit_create(const conc_limit_attr_t *attr) {
+	conc_limit_t *cl;
+
+	if (!attr || attr->min_limit < 1 || attr->max_limit < attr->min_limit) {
+		return NULL;
+	}
+
+	cl = (conc_limit_t *)calloc(1, sizeof(conc_limit_t));
+	if (!cl) {
+		return NULL;
+	}
+
+	cl->min_limit 	= attr->min_limit;
+	cl->max_limit 	= attr->max_limit;
+	cl->smoothing 	= attr->smoothing > 0 && attr->smoothing <= 1 ? attr->smoothing : 0.2;
+	cl->tolerance 	= attr->tolerance >= 1 ? attr->tolerance : 1;
+	cl->window 	= attr->window > 0 ? attr->window : CONC_LIMIT_WINDOW_DEFAULT;
+
+	cl->estimate = attr->initial_limit;
+	if (cl->estimate < cl->min_limit) {
+		cl->estimate = cl->min_limit;
+	} else if (cl->estimate > cl->max_limit) {
+		cl->estimate = cl->max_limit;
+	}
+	cl->limit = (int)cl->estimate;
+
+	pthread_mutex_init(&cl->mutex, NULL);
+
+	return cl;
+}
+
+void conc_limit_destroy(conc_limit_t *cl) {
+	if (!cl) {
+		return;
+	}
+
+	pthread_mutex_destroy(&cl->mutex);
+	free(cl);
+}
+
+uint64_t conc_limit_start(conc_limit_t *cl) {
+	pthread_mutex_lock(&cl->mutex);
+	if (++cl->inflight > cl->inflight_max) {
+		cl->inflight_max = cl->inflight;
+	}
+	pthread_mutex_unlock(&cl->mutex);
+
+	return conc_limit_now_ns();
+}
+
+int conc_limit_end(conc_limit_t *cl, const uint64_t start) {
+	uint64_t rtt = conc_limit_now_ns() - start;
+	int changed = 0;
+
+	pthread_mutex_lock(&cl->mutex);
+	cl->inflight--;
+	cl->sum_ns += rtt;
+	if (++cl->samples >= cl->window) {
+		changed = conc_limit_update(cl);
+	}
+	pthread_mutex_unlock(&cl->mutex);
+
+	return changed;
+}
+
+void conc_limit_busy(conc_limit_t *cl, const int busy) {
+	pthread_mutex_lock(&cl->mutex);
+	if (busy > cl->busy_max) {
+		cl->busy_max = busy;
+	}
+	pthread_mutex_unlock(&cl->mutex);
+}
+
+int conc_limit_get(conc_limit_t *cl) {
+	int limit;
+
+	pthread_mutex_lock(&cl->mutex);
+	limit = cl->limit;
+	pthread_mutex_unlock(&cl->mutex);
+
+	return limit;
+}
+
+void conc_limit_get_stats(conc_limit_t *cl, conc_limit_stats_t *stats) {
+	if (!cl || !stats) {
+		return;
+	}
+
+	pthread_mutex_lock(&cl->mutex);
+	stats->limit 		= cl->limit;
+	stats->inflight 	= cl->inflight;
+	stats->rtt_us 		= (unsigned long long)(cl->rtt_ns / 1000);
+	stats->rtt_noload_us 	= (unsigned long long)(conc_limit_baseline(cl) / 1000);
+	pthread_mutex_unlock(&cl->mutex);
+}
+
+static uint64_t conc_limit_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the minimum over one to two periods, so that it follows the resource
+ * getting slower for good */
+static double conc_limit_baseline(const conc_limit_t *cl) {
+	if (!cl->rtt_min_ns[0] || (cl->rtt_min_ns[1] && cl->rtt_min_ns[1] < cl->rtt_min_ns[0])) {
+		return cl->rtt_min_ns[1];
+	}
+	return cl->rtt_min_ns[0];
+}
+
+/* Ends a window, called with the mutex locked. The gradient is the no
+ * load round trip over the window one, 1 when nothing queues and below
+ * when calls wait on each other. The limit follows it, plus a headroom
+ * of sqrt(limit) so that growth is probed, and is not raised by a window
+ * that did not use half of it.
+ */
+static int conc_limit_update(conc_limit_t *cl) {
+	double gradient, estimate, baseline;
+	int limit, app_limited = cl->inflight_max < cl->estimate / 2 && cl->busy_max < cl->estimate / 2;
+
+	cl->rtt_ns 	 = (double)cl->sum_ns / cl->samples;
+	cl->samples 	 = 0;
+	cl->sum_ns 	 = 0;
+	cl->inflight_max = cl->inflight;
+	cl->busy_max 	 = 0;
+
+	if (!cl->rtt_min_ns[1] || cl->rtt_ns < cl->rtt_min_ns[1]) {
+		cl->rtt_min_ns[1] = cl->rtt_ns;
+	}
+	baseline = conc_limit_baseline(cl);
+	if (++cl->windows >= CONC_LIMIT_BASELINE_WINDOWS) {
+		cl->rtt_min_ns[0] = cl->rtt_min_ns[1];
+		cl->rtt_min_ns[1] = 0;
+		cl->windows 	  = 0;
+	}
+
+	gradient = cl->rtt_ns > 0 ? cl->tolerance * baseline / cl->rtt_ns : 1;
+	if (gradient > 1) {
+		gradient = 1;
+	} else if (gradient < 0.5) {
+		gradient = 0.5;
+	}
+
+	estimate = cl->estimate * gradient + sqrt(cl->estimate);
+	if (app_limited && estimate > cl->estimate) {
+		return 0;
+	}
+
+	estimate = cl->estimate * (1 - cl->smoothing) + estimate * cl->smoothing;
+	if (estimate < cl->min_limit) {
+		estimate = cl->min_limit;
+	} else if (estimate > cl->max_limit) {
+		estimate = cl->max_limit;
+	}
+	cl->estimate = estimate;
+
+	limit = (int)(estimate + 0.5);
+	if (limit == cl->limit) {
+		return 0;
+	}
+	cl->limit = limit;
+
+	return 1;
+}
@@ -192,7 +192,7 @@ typedef struct {
 	char timedate[TIMEDATE_LENGTH];
 
 	uint8_t data[DEVICE_DATA_MAX_LENGTH];
-	uint8_t data_length;
+	uint16_t data_length;
 } sensor_data_t;
 
 /* Provioned for gateway statistics */
@@ -217,7 +217,7 @@ void	*gateway_mngr(void *gw_conf);
 void gateway_protocol_data_send_payload_decode(
 	sensor_data_t *sensor_data, 
 	const uint8_t *payload, 
-	const uint8_t payload_length);
+	const uint16_t payload_length);
 
 uint8_t gateway_protocol_checkup_callback(gateway_protocol_conf_t *gwp_conf);
 
@@ -268,7 +268,7 @@ static void hnd_get_epoch(coap_context_t *ctx UNUSED_PARAM,
 	gateway_protocol_conf_t gwp_conf;
 	char *pak; // pointer to app_key
 	uint8_t buf[64];
-	uint8_t buf_len = 0;
+	uint16_t buf_len = 0;
 
 	/* first ocurrence must be given by app_key=******** */
 	pak = memchr(query->s, '=', strlen((char *)query->s)-1);
@@ -310,7 +310,7 @@ static void hnd_post_data(coap_context_t *ctx UNUSED_PARAM,
 	size_t packet_length;
 	gateway_protocol_conf_t gwp_conf;
 	uint8_t payload[DEVICE_DATA_MAX_LENGTH];
-	uint8_t payload_length = 0;
+	uint16_t payload_length = 0;
 	PGresult *res;
 	int i;
 
@@ -320,6 +320,10 @@ static void hnd_post_data(coap_context_t *ctx UNUSED_PARAM,
 		// bad request 400
 		response->code = COAP_RESPONSE_CODE(400);
 		fprintf(stderr, "error : no incoming data\n");
+	} else if (packet_length > DEVICE_DATA_MAX_LENGTH) {
+		// the payload is decoded into a buffer of that size
+		response->code = COAP_RESPONSE_CODE(413);
+		fprintf(stderr, "error : packet too long\n");
 	} else {
 		printf("incoming data:\n");
     		for (i = 0; i < packet_length; i++) {
@@ -417,9 +421,9 @@ static void hnd_get_data(coap_context_t *ctx UNUSED_PARAM,
 {
 	gateway_protocol_conf_t gwp_conf;
 	uint8_t payload[DEVICE_DATA_MAX_LENGTH];
-	uint8_t payload_length = 0;
+	uint16_t payload_length = 0;
 	uint8_t packet[DEVICE_DATA_MAX_LENGTH];
-	uint8_t packet_length = 0;
+	uint16_t packet_length = 0;
 	PGresult *res;
 	char *pak;
 
@@ -504,7 +508,7 @@ uint8_t gateway_protocol_checkup_callback(gateway_protocol_conf_t *gwp_conf) {
 void gateway_protocol_data_send_payload_decode(
 	sensor_data_t *sensor_data, 
 	const uint8_t *payload, 
-	const uint8_t payload_length) 
+	const uint16_t payload_length) 
 {
 	uint8_t p_len = 0;
 
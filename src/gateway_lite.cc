@@ -2,16 +2,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <arpa/inet.h> //inet_addr
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <libpq-fe.h>
 #include <math.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <linux/filter.h>
 
 #include <errno.h>
 
@@ -19,17 +26,30 @@
 #include "gateway_telemetry_protocol.h"
 #include "base64.h"
 #include "task_queue.h"
+#include "task_pipeline.h"
+#include "conc_limit.h"
+#include "obj_pool.h"
+#include "io_ring.h"
 #include "json.h"
-#include "aes.h"
+extern "C" {
+#include "aes.h"	// tiny-AES-c has no C++ guard
+}
 #include "gw_stat_linked_list.h"
 
 
 #define TIMEDATE_LENGTH			32
 #define PEND_SEND_RETRIES_MAX		5
+#define PEND_SEND_RETRY_MS		300
 #define GATEWAY_PROTOCOL_APP_KEY_SIZE	8
 #define DEVICE_DATA_MAX_LENGTH		256
 #define GATEWAY_SECURE_KEY_SIZE		16
 #define GATEWAY_ID_SIZE			6
+#define GATEWAY_EPOLL_EVENTS		64
+#define GATEWAY_RING_ENTRIES		256
+#define GATEWAY_UDP_BATCH		32
+#define GATEWAY_REPLY_FRAMES		3	// ACK, PEND_SEND and TIME_SEND
+#define SEND_WAIT_MS			1000
+#define GATEWAY_APP_KEY_BUCKETS		64
 
 
 typedef struct {
@@ -49,6 +69,31 @@ typedef struct {
 	char 		platform_gw_manager_ip[20];
 	uint16_t 	platform_gw_manager_port;
 	uint8_t 	thread_pool_size;
+	uint8_t 	thread_pool_min_size;
+	char		task_queue_backend[8];
+	uint32_t	task_queue_capacity;
+	uint8_t		task_queue_dispatch_hash;
+	uint8_t		task_queue_sched_weighted;
+	int		task_queue_weights[TASK_QUEUE_PRIO_NUM];
+	uint32_t	task_queue_max_size;
+	char		task_queue_overflow[12];
+	uint16_t	task_queue_batch_max;
+	uint16_t	task_queue_batch_wait_ms;
+	uint8_t		decode_pool_size;
+	uint32_t	deadline_decode_ms;	// undecoded requests, 0 for no deadline
+	uint32_t	deadline_time_req_ms;
+	uint32_t	deadline_data_send_ms;
+	uint32_t	deadline_pend_req_ms;
+	uint32_t	deadline_stat_ms;
+	uint32_t	recv_timeout_ms;	// a connection has that long to send its packet
+	uint32_t	keep_alive_idle_ms;	// 0 closes connections after one packet
+	uint16_t	keep_alive_inflight_max;// packets of a connection processed at once
+	uint8_t		listener_threads;	// each with its own SO_REUSEPORT socket
+	uint8_t		listener_steer_hash;	// a source address always lands on the same listener
+	uint8_t		io_uring;		// listeners run on io_uring if the kernel has it
+	uint16_t	udp_port;		// datagrams of one packet each, 0 for none
+	uint8_t		downlink_coalesce;	// PEND_SEND and TIME_SEND follow the ack of a DATA_SEND
+	uint16_t	frame_size_max;		// longer packets are refused
 } static_conf_t;
 
 typedef struct {
@@ -60,10 +105,14 @@ typedef struct {
 	uint32_t utc;
 	char timedate[TIMEDATE_LENGTH];
 
-	uint8_t data[DEVICE_DATA_MAX_LENGTH];
-	uint8_t data_length;
+	const uint8_t *data;		// in the packet of the request
+	uint16_t data_length;
 } sensor_data_t;
 
+struct gcom_client;
+struct gcom_loop;
+struct gcom_udp;
+
 typedef struct {
 	gateway_protocol_conf_t gwp_conf;
 	int server_desc;
@@ -71,19 +120,112 @@ typedef struct {
 	struct sockaddr_in server;
 	struct sockaddr_in client;
 	unsigned int sock_len;
+	struct gcom_client *session;	// connection of client_desc, NULL if not shared
+	struct gcom_udp *udp;		// datagram listener answering for it, NULL for TCP
 } gcom_ch_t; // gateway communication channel
 
 typedef struct {
 	gcom_ch_t gch;	
 	gateway_protocol_packet_type_t packet_type;
-	uint8_t packet[DEVICE_DATA_MAX_LENGTH];
-	uint8_t packet_length;
+	uint16_t packet_length;
+	const uint8_t *payload;		// in packet, decoded in place
+	uint16_t payload_length;
+	char msg_cont[150];		// pending message being sent
+	uint8_t pend_send_retries;
+	uint64_t recv_ns;		// task_queue_now_ns() once received
+	uint64_t deadline_ns;		// the client is not expected to wait longer
+	uint8_t packet[];		// frame_size_max bytes
 } gcom_ch_request_t;
 
+/* A device connection, read by the main thread as data arrives so that a
+ * slow client holds no one else up, each frame becomes a request. The
+ * loop and the requests in flight hold a reference, the socket is closed
+ * with the last one.
+ */
+typedef struct gcom_client {
+	int desc;
+	int refs;
+	int inflight;			// requests not done with yet
+	uint8_t paused;			// at the in-flight cap, resumed by a worker
+	uint8_t shut;			// the client shut down its side
+	pthread_mutex_t send_mutex;	// answers of concurrent requests do not interleave
+	struct gcom_loop *loop;
+	gcom_ch_request_t *req;		// the next packet is received into req->packet,
+					// NULL once the loop released the connection
+	gcom_ch_request_t *ring_req;	// of the receive in the ring, NULL if none
+	uint16_t recv_length;
+	int32_t frame_length;		// 0 until the header is in, -1 framed by the shutdown
+	uint64_t expire_ns;		// closed if idle by then
+	struct gcom_client *prev;
+	struct gcom_client *next;
+	struct gcom_client *resume_next;
+} gcom_client_t;
+
+/* event loop of the listener, clients are kept by expiry */
+typedef struct gcom_loop {
+	gcom_ch_t *gch;
+	io_ring_t *ring;		// completions instead of epoll events, NULL for epoll
+	int epoll_desc;
+	int event_desc;			// eventfd, connections to resume
+	eventfd_t event_value;		// read by the ring
+	uint8_t accept_multishot;
+	int ring_recvs;			// receives in the ring
+	obj_pool_t *client_pool;
+	gcom_client_t *first;
+	gcom_client_t *last;
+	gcom_client_t *released;	// their loop reference goes after the round
+	pthread_mutex_t resume_mutex;
+	gcom_client_t *resume;
+	uint64_t timeout_ns;
+	uint8_t keep_alive;
+	int inflight_max;
+} gcom_loop_t;
+
+/* replies waiting for the next sendmmsg */
+typedef struct {
+	struct mmsghdr msgs[GATEWAY_UDP_BATCH];
+	struct iovec iovs[GATEWAY_UDP_BATCH];
+	struct sockaddr_in addrs[GATEWAY_UDP_BATCH];
+	uint8_t pcks[GATEWAY_UDP_BATCH][DEVICE_DATA_MAX_LENGTH];
+	int length;
+} gcom_udp_batch_t;
+
+/* Datagram listener, each datagram is a packet and becomes a request.
+ * They are received and the replies sent by batches: a worker queues its
+ * reply and the one that finds no flush going on sends what was queued
+ * until nothing is left, while the others queue into the other batch.
+ */
+typedef struct gcom_udp {
+	gcom_ch_t gch;			// server_desc is the socket
+	pthread_t thread;
+	pthread_mutex_t send_mutex;
+	pthread_cond_t send_cond;	// signalled when a batch is taken
+	gcom_udp_batch_t batches[2];
+	int queuing;			// batch replies are added to
+	uint8_t flushing;
+} gcom_udp_t;
+
+/* what the receiver needs to find the end of a frame of an application */
+typedef struct gcom_app_key {
+	uint8_t app_key[GATEWAY_PROTOCOL_APPKEY_SIZE];
+	uint8_t secure;
+	struct AES_ctx aes_ctx;		// expanded secure key
+	struct gcom_app_key *next;
+} gcom_app_key_t;
+
 typedef struct {
 	uint64_t errors_count;
 } gw_stat_t;
 
+/* request processing stages */
+typedef enum {
+	GATEWAY_STAGE_DECODE = 0,	// decrypt and decode, cpu bound
+	GATEWAY_STAGE_REQUEST,		// database and response, one at a time per request
+	GATEWAY_STAGE_DATA,		// DATA_SEND batches, shares the request stage workers
+	GATEWAY_STAGE_PEND,		// PEND_SEND ack polling, shares the request stage workers
+	GATEWAY_STAGE_NUM
+} gateway_stage_t;
+
 static const char * static_conf_file  = "conf/static.conf";
 static const char * dynamic_conf_file = "conf/dynamic.conf";
 static int read_static_conf (const char *static_conf_file_path,  gw_conf_t *gw_conf);
@@ -91,25 +233,87 @@ static int read_dynamic_conf(const char *dynamic_conf_file_path, gw_conf_t *gw_c
 static void process_static_conf (json_value* value, static_conf_t  *static_conf);
 static void process_dynamic_conf(json_value* value, dynamic_conf_t *dynamic_conf);
 static json_value * read_json_conf(const char *file_path);
-
-void process_packet(void *request);
+static json_value * json_conf_get(json_value *value, const char *name);
+
+int process_packet(void *request, task_job_attr_t *tj_attr);
+int process_request(void *request, task_job_attr_t *tj_attr);
+int process_data_records(gcom_ch_request_t *req, task_job_attr_t *tj_attr);
+void process_data_batch(void **requests, int count);
+int process_pend_retry(void *request, task_job_attr_t *tj_attr);
+void process_drop(void *request, int stage);
+void gcom_ch_request_shed(gcom_ch_request_t *req, uint8_t decoded);
+int gcom_ch_request_hint(const gcom_ch_request_t *req);
+PGresult * db_exec(const char *query);
+PGresult * db_exec_params(const char *query, int n_params, const char * const *values, const int *lengths, const int *formats);
+long gcom_ch_request_key(const gcom_ch_request_t *req);
+uint64_t gcom_ch_request_deadline(gcom_ch_request_t *req, uint32_t budget_ms);
+long gcom_app_flow(const char *app_key);
+uint32_t gcom_app_key_hash(const uint8_t *app_key);
+void gateway_apps_load(void);
+void gateway_flow_weights_load(void);
 
 uint8_t gateway_auth(const gw_conf_t *gw_conf, const char *dynamic_conf_file_path);
 void	*gateway_mngr(void *gw_conf);
 
-int send_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint8_t pck_size);
-int recv_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint8_t *pck_length, uint16_t pck_size);
+int send_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint16_t pck_size);
+int send_gcom_ch_iov(gcom_ch_t *gch, struct iovec *iov, int iovcnt);
+int recv_gcom_ch(gcom_client_t *client);
+int gcom_frame_length(const uint8_t *pck, uint16_t pck_length);
+
+int gcom_ch_listen(gcom_ch_t *gch, uint16_t port, uint8_t reuseport);
+int gcom_listeners_steer(int server_desc, int listeners_num);
+int gcom_loop_init(gcom_loop_t *loop, gcom_ch_t *gch);
+int gcom_loop_init_ring(gcom_loop_t *loop);
+void gcom_loop_destroy(gcom_loop_t *loop);
+void gcom_loop_run(gcom_loop_t *loop);
+void gcom_loop_run_ring(gcom_loop_t *loop);
+void gcom_loop_complete(gcom_loop_t *loop, const io_ring_event_t *ev);
+void * gcom_loop_thread(void *loop);
+void gcom_loop_wakeup(gcom_loop_t *loop);
+int gcom_loop_expire(gcom_loop_t *loop);
+void gcom_loop_resume(gcom_loop_t *loop);
+void gcom_loop_flush(gcom_loop_t *loop);
+int gcom_ch_accept(gcom_loop_t *loop);
+gcom_client_t * gcom_client_open(gcom_loop_t *loop, int desc, const struct sockaddr_in *addr, socklen_t addr_len);
+void gcom_client_recv(gcom_loop_t *loop, gcom_client_t *client);
+void gcom_client_process(gcom_loop_t *loop, gcom_client_t *client);
+gcom_ch_request_t * gcom_client_next(gcom_client_t *client, gcom_ch_request_t *req);
+void gcom_client_touch(gcom_loop_t *loop, gcom_client_t *client);
+void gcom_client_release(gcom_loop_t *loop, gcom_client_t *client);
+void gcom_client_put(gcom_client_t *client);
+void gcom_ch_request_submit(gcom_ch_request_t *req);
+void gcom_ch_request_mk_pend(gcom_ch_request_t *req, const char *msg);
+int gcom_ch_request_pend(gcom_ch_request_t *req, task_job_attr_t *tj_attr);
+int gcom_ch_request_ack(gcom_ch_request_t *req, task_job_attr_t *tj_attr, uint8_t time_unset);
+void gcom_ch_request_free(gcom_ch_request_t *req);
+void gcom_ch_shutdown(gcom_ch_t *gch);
+
+int gcom_udp_open(gcom_udp_t *udp, uint16_t port);
+void gcom_udp_stop(gcom_udp_t *udp);
+void * gcom_udp_thread(void *udp);
+int gcom_udp_send(gcom_udp_t *udp, const struct sockaddr_in *addr, const uint8_t *pck, uint16_t pck_size);
+
+uint8_t gateway_protocol_data_send_payload_view(
+	sensor_data_t *sensor_data, 
+	const uint8_t *payload, 
+	const uint16_t payload_length);
 
-void gateway_protocol_data_send_payload_decode(
+uint8_t gateway_protocol_data_record_view(
 	sensor_data_t *sensor_data, 
 	const uint8_t *payload, 
-	const uint8_t payload_length);
+	const uint16_t payload_length,
+	uint16_t *offset);
 
 void gateway_protocol_mk_stat(
 	gcom_ch_t *gch,
 	gateway_protocol_stat_t stat,
 	uint8_t *pck,
-	uint8_t *pck_len);
+	uint16_t *pck_len);
+
+void gateway_protocol_mk_utc(
+	gcom_ch_t *gch,
+	uint8_t *pck,
+	uint16_t *pck_len);
 
 void send_utc(gcom_ch_t *pch);
 
@@ -121,14 +325,27 @@ static volatile uint8_t working = 1;
 pthread_mutex_t mutex;
 pthread_mutex_t gw_stat_mutex;
 PGconn *conn;
+task_pipeline_t *pipeline;
+obj_pool_t *req_pool;
+uint16_t data_batch_max;
+conc_limit_t *db_limit;
+const static_conf_t *gw_static_conf;
+pthread_mutex_t app_keys_mutex = PTHREAD_MUTEX_INITIALIZER;	// used by the manager from its start
+gcom_app_key_t *app_keys[GATEWAY_APP_KEY_BUCKETS];
 
 gw_stat_t gw_stat;
 
 int main (int argc, char **argv) {
 	gw_conf_t *gw_conf = (gw_conf_t *)malloc(sizeof(gw_conf_t));
 	char *db_conninfo = (char *)malloc(512);
-	gcom_ch_t gch;
-	task_queue_t *tq;
+	gcom_ch_t gch, *gchs;
+	task_queue_attr_t tq_attr;
+	task_stage_attr_t stages[GATEWAY_STAGE_NUM];
+	conc_limit_attr_t cl_attr;
+	gcom_loop_t *loops;
+	gcom_udp_t *udp = NULL;
+	pthread_t *listeners;
+	int listeners_num;
 	pthread_t gw_mngr;
 	sigset_t sigset;
 	
@@ -137,6 +354,9 @@ int main (int argc, char **argv) {
 	sigemptyset(&sigset);
 	/* block SIGALRM for gateway manager thread */
 	sigaddset(&sigset, SIGALRM);
+	/* SIGINT is taken by the main thread once it listens, the threads
+	 * created until then inherit the mask */
+	sigaddset(&sigset, SIGINT);
 	sigprocmask(SIG_BLOCK, &sigset, NULL);
 
 	signal(SIGINT, ctrc_handler);
@@ -144,6 +364,7 @@ int main (int argc, char **argv) {
 	if (read_static_conf(static_conf_file, gw_conf)) {
 		return EXIT_FAILURE;
 	}
+	gw_static_conf = &gw_conf->static_conf;
 
 	gateway_telemetry_protocol_init(gw_conf->static_conf.gw_id, gw_conf->static_conf.gw_secure_key);
 
@@ -186,453 +407,2241 @@ int main (int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	if ((gch.server_desc = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		perror("socket creation error");
+	/* the other listeners join the port of the first one later on */
+	listeners_num = gw_conf->static_conf.listener_threads ? gw_conf->static_conf.listener_threads : 1;
+	if (gcom_ch_listen(&gch, gw_conf->static_conf.gw_port, listeners_num > 1)) {
 		free(gw_conf);
 		return EXIT_FAILURE;
 	}
 
-	gch.server.sin_family 		= AF_INET;
-	gch.server.sin_port		= htons(gw_conf->static_conf.gw_port);
-	gch.server.sin_addr.s_addr 	= htonl(INADDR_ANY);
-
-	if (bind(gch.server_desc, (struct sockaddr *) &gch.server, sizeof(gch.server)) < 0) {
-		perror("binding error");
-		free(gw_conf);
-		return EXIT_FAILURE;
-	}
-	
-	if (listen(gch.server_desc, gw_conf->static_conf.thread_pool_size) < 0) {
-		perror("listen error");
+	if (pthread_create(&gw_mngr, NULL, gateway_mngr, gw_conf)) {
+		fprintf(stderr, "Failed to create gateway manager thread.");
 		free(gw_conf);
 		close(gch.server_desc);
 		return EXIT_FAILURE;
 	}
 
-	if (pthread_create(&gw_mngr, NULL, gateway_mngr, gw_conf)) {
-		fprintf(stderr, "Failed to create gateway manager thread.");
+	task_queue_attr_init(&tq_attr);
+	tq_attr.max_threads = gw_conf->static_conf.thread_pool_size;
+	tq_attr.capacity = gw_conf->static_conf.task_queue_capacity;
+	if (!strcmp(gw_conf->static_conf.task_queue_backend, "ring")) {
+		tq_attr.backend = TASK_QUEUE_BACKEND_RING;
+	} else if (!strcmp(gw_conf->static_conf.task_queue_backend, "steal")) {
+		tq_attr.backend = TASK_QUEUE_BACKEND_STEAL;
+	}
+	if (gw_conf->static_conf.task_queue_sched_weighted) {
+		tq_attr.sched = TASK_QUEUE_SCHED_WEIGHTED;
+		memcpy(tq_attr.weights, gw_conf->static_conf.task_queue_weights, sizeof(tq_attr.weights));
+	}
+	tq_attr.max_size = gw_conf->static_conf.task_queue_max_size;
+	if (!strcmp(gw_conf->static_conf.task_queue_overflow, "drop_oldest")) {
+		tq_attr.overflow = TASK_QUEUE_OVERFLOW_DROP_OLDEST;
+	} else if (!strcmp(gw_conf->static_conf.task_queue_overflow, "block")) {
+		tq_attr.overflow = TASK_QUEUE_OVERFLOW_BLOCK;
+	}
+	tq_attr.batch_max = data_batch_max = gw_conf->static_conf.task_queue_batch_max;
+	tq_attr.batch_wait_us = gw_conf->static_conf.task_queue_batch_wait_ms * 1000;
+
+	/* each stage pool is sized for what it waits on */
+	for (int i = 0; i < GATEWAY_STAGE_NUM; i++) {
+		task_stage_attr_init(&stages[i]);
+	}
+	stages[GATEWAY_STAGE_DECODE].name = "decode";
+	stages[GATEWAY_STAGE_DECODE].func = process_packet;
+	stages[GATEWAY_STAGE_DECODE].queue_attr = tq_attr;
+	stages[GATEWAY_STAGE_DECODE].queue_attr.max_threads = gw_conf->static_conf.decode_pool_size;
+	stages[GATEWAY_STAGE_DECODE].queue_attr.batch_max = 1;
+	stages[GATEWAY_STAGE_REQUEST].name = "request";
+	stages[GATEWAY_STAGE_REQUEST].func = process_request;
+	stages[GATEWAY_STAGE_REQUEST].queue_attr = tq_attr;
+	stages[GATEWAY_STAGE_DATA].name = "data";
+	stages[GATEWAY_STAGE_DATA].batch_func = process_data_batch;
+	stages[GATEWAY_STAGE_DATA].queue_stage = GATEWAY_STAGE_REQUEST;
+	stages[GATEWAY_STAGE_PEND].name = "pend";
+	stages[GATEWAY_STAGE_PEND].func = process_pend_retry;
+	stages[GATEWAY_STAGE_PEND].queue_stage = GATEWAY_STAGE_REQUEST;
+
+	/* requests are allocated here and freed by the workers */
+	if (!(req_pool = obj_pool_create(sizeof(gcom_ch_request_t) + gw_conf->static_conf.frame_size_max, 0))) {
+		perror("request pool creation error");
 		free(gw_conf);
 		close(gch.server_desc);
 		return EXIT_FAILURE;
 	}
 
-	if(!(tq = task_queue_create(gw_conf->static_conf.thread_pool_size))) {
-		perror("task_queue creation error");
+	if(!(pipeline = task_pipeline_create(stages, GATEWAY_STAGE_NUM, process_drop))) {
+		perror("task_pipeline creation error");
 		free(gw_conf);
 		close(gch.server_desc);
 		return EXIT_FAILURE;
 	}
 
+	/* request workers beyond what the database round trip shows to be
+	 * useful are parked, thread_pool_size is the upper bound */
+	if (gw_conf->static_conf.thread_pool_min_size < gw_conf->static_conf.thread_pool_size) {
+		conc_limit_attr_init(&cl_attr);
+		cl_attr.min_limit = gw_conf->static_conf.thread_pool_min_size;
+		cl_attr.max_limit = gw_conf->static_conf.thread_pool_size;
+		cl_attr.initial_limit = gw_conf->static_conf.thread_pool_min_size;
+		if (!(db_limit = conc_limit_create(&cl_attr))) {
+			fprintf(stderr, "concurrency limit creation error, fixed pool\n");
+		}
+	}
+
 	pthread_mutex_init(&mutex, NULL);
 	pthread_mutex_init(&gw_stat_mutex, NULL);
 
+	gateway_apps_load();
+
 	gateway_protocol_set_checkup_callback(gateway_protocol_checkup_callback);
 
 	gw_stat_linked_list_init();
 
-	while (working) {
-		printf("listenninig...\n");
-		
-		gcom_ch_request_t *req = (gcom_ch_request_t *)malloc(sizeof(gcom_ch_request_t));
-		memset(req, 0x0, sizeof(gcom_ch_request_t));
-		memcpy(&req->gch, &gch, sizeof(gcom_ch_t));
+	gchs 		= (gcom_ch_t *)calloc(listeners_num, sizeof(gcom_ch_t));
+	loops 		= (gcom_loop_t *)calloc(listeners_num, sizeof(gcom_loop_t));
+	listeners 	= (pthread_t *)calloc(listeners_num, sizeof(pthread_t));
+	if (!gchs || !loops || !listeners) {
+		perror("listeners allocation error");
+		free(gw_conf);
+		close(gch.server_desc);
+		return EXIT_FAILURE;
+	}
 
-		req->gch.sock_len = sizeof(req->gch.client);
-		
-		if (recv_gcom_ch(&req->gch, req->packet, &req->packet_length, DEVICE_DATA_MAX_LENGTH)) {
-			task_queue_enqueue(tq, process_packet, req);
-		} else {
-			fprintf(stderr, "packet receive error\n");
+	gchs[0] = gch;
+	for (int i = 1; i < listeners_num; i++) {
+		if (gcom_ch_listen(&gchs[i], gw_conf->static_conf.gw_port, 1)) {
+			fprintf(stderr, "listener %d creation error, %d listeners\n", i, i);
+			listeners_num = i;
+			break;
+		}
+	}
+	if (listeners_num > 1 && gw_conf->static_conf.listener_steer_hash &&
+	    gcom_listeners_steer(gchs[0].server_desc, listeners_num)) {
+		perror("listener steering error, kernel balanced");
+	}
+
+	for (int i = 0; i < listeners_num; i++) {
+		if (gcom_loop_init(&loops[i], &gchs[i])) {
+			perror("event loop creation error");
+			free(gw_conf);
+			close(gch.server_desc);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int i = 1; i < listeners_num; i++) {
+		if (pthread_create(&listeners[i], NULL, gcom_loop_thread, &loops[i])) {
+			fprintf(stderr, "listener thread creation error\n");
+			free(gw_conf);
+			close(gch.server_desc);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (gw_conf->static_conf.udp_port) {
+		if (!(udp = (gcom_udp_t *)calloc(1, sizeof(gcom_udp_t))) ||
+		    gcom_udp_open(udp, gw_conf->static_conf.udp_port) ||
+		    pthread_create(&udp->thread, NULL, gcom_udp_thread, udp)) {
+			fprintf(stderr, "udp listener creation error\n");
+			free(gw_conf);
+			close(gch.server_desc);
+			return EXIT_FAILURE;
 		}
 	}
 
+	/* the main thread wakes the other listeners once interrupted */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
+
+	printf("listenninig...\n");
+
+	gcom_loop_run(&loops[0]);
+
+	for (int i = 1; i < listeners_num; i++) {
+		gcom_loop_wakeup(&loops[i]);
+		pthread_join(listeners[i], NULL);
+	}
+	if (udp) {
+		gcom_udp_stop(udp);
+	}
+
+	/* the requests in flight are answered before the connections go */
+	task_pipeline_destroy(pipeline);
+	pipeline = NULL;
+
+	for (int i = 0; i < listeners_num; i++) {
+		gcom_loop_destroy(&loops[i]);
+		close(gchs[i].server_desc);
+	}
+	obj_pool_destroy(req_pool);
+	conc_limit_destroy(db_limit);
+
+	if (udp) {
+		close(udp->gch.server_desc);
+		pthread_mutex_destroy(&udp->send_mutex);
+		pthread_cond_destroy(&udp->send_cond);
+		free(udp);
+	}
+
+	free(listeners);
+	free(loops);
+	free(gchs);
 	free(gw_conf);
 	pthread_mutex_destroy(&mutex);
-	close(gch.server_desc);
 	PQfinish(conn);
 
 	return EXIT_SUCCESS;
 }
 
 void ctrc_handler (int sig) {
-	working = 0;
+	__atomic_store_n(&working, 0, __ATOMIC_RELAXED); // read by every listener
 }
 
-void process_packet(void *request) {
+int process_packet(void *request, task_job_attr_t *tj_attr) {
 	gcom_ch_request_t *req = (gcom_ch_request_t *)request;
-	uint8_t payload[DEVICE_DATA_MAX_LENGTH];
-	uint8_t payload_length;	
-	PGresult *res;
+	gateway_protocol_packet_view_t view;
 
-	if (gateway_protocol_packet_decode(
+	/* the payload stays in the packet until the answer is written there */
+	if (!gateway_protocol_packet_view(
 		&(req->gch.gwp_conf),
-		&(req->packet_type),
-		&payload_length, payload,
+		&view,
 		req->packet_length, req->packet))
 	{
-		if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_TIME_REQ) {
-			printf("TIME REQ received\n");
-			send_utc(&(req->gch));
-		} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND) {
-			sensor_data_t sensor_data;
-			time_t t;
-			// DEVICE_DATA_MAX_LENGTH*2 {hex} + 150
-			char db_query[662];
-
-			printf("DATA SEND received\n");
-			gateway_protocol_data_send_payload_decode(&sensor_data, payload, payload_length);
-			
-			if (sensor_data.utc == 0) {
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				t = tv.tv_sec;
-			} else {
-				t = sensor_data.utc;
-			}
-			
-			strftime(sensor_data.timedate, TIMEDATE_LENGTH, "%d/%m/%Y %H:%M:%S", localtime(&t));
-			snprintf(db_query, sizeof(db_query), 
-				"INSERT INTO dev_%s_%d VALUES (%lu, '%s', $1)", 
-				(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id, t, sensor_data.timedate
-			);
-			
-			const char *params[1];
-			int paramslen[1];
-			int paramsfor[1];
-			params[0] = (char *) sensor_data.data;
-			paramslen[0] = sensor_data.data_length;
-			paramsfor[0] = 1; // format - binary
-
-			pthread_mutex_lock(&gw_stat_mutex);
-			gw_stat_linked_list_add((char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
-			pthread_mutex_unlock(&gw_stat_mutex);
-
-			pthread_mutex_lock(&mutex);
-			res = PQexecParams(conn, db_query, 1, NULL, params, paramslen, paramsfor, 0);
-			pthread_mutex_unlock(&mutex);
-
-			if (PQresultStatus(res) == PGRES_COMMAND_OK) {
-				PQclear(res);
-
-				snprintf(db_query, sizeof(db_query),
-					 "SELECT * FROM pend_msgs WHERE app_key='%s' and dev_id = %d and ack = False", 
-					(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
-				);
-				
-				pthread_mutex_lock(&mutex);
-				res = PQexec(conn, db_query);
-				pthread_mutex_unlock(&mutex);
-				
-				if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
-					gateway_protocol_mk_stat(
-						&(req->gch), 
-						GATEWAY_PROTOCOL_STAT_ACK_PEND,
-						req->packet, &(req->packet_length));
-					printf("ACK_PEND prepared\n");
-				} else {
-					gateway_protocol_mk_stat(
-						&(req->gch), 
-						GATEWAY_PROTOCOL_STAT_ACK,
-						req->packet, &(req->packet_length));
-					printf("ACK prepared\n");
-				}
-				
-				send_gcom_ch(&(req->gch), req->packet, req->packet_length);
-			} else {
-				fprintf(stderr, "database error : %s\n", PQerrorMessage(conn));
-				gw_stat.errors_count++;
-			}
-			PQclear(res);
-		} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_PEND_REQ) {
-			char db_query[200];
-			snprintf(db_query, sizeof(db_query),
-				 "SELECT * FROM pend_msgs WHERE app_key = '%s' AND dev_id = %d AND ack = False", 
-				(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
-			);
-			pthread_mutex_lock(&mutex);
-			res = PQexec(conn, db_query);
-			pthread_mutex_unlock(&mutex);
-			
-			if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
-				char msg_cont[150];
-				strncpy(msg_cont, PQgetvalue(res, 0, 2), sizeof(msg_cont));
-				printf("PEND_SEND prepared : %s\n", msg_cont);
-				PQclear(res);
-			
-				base64_decode(msg_cont, strlen(msg_cont)-1, payload);
-				payload_length = BASE64_DECODE_OUT_SIZE(strlen(msg_cont));
-				printf("prepared to send %d bytes : %s\n", payload_length, payload);
-				
-				// send the msg until ack is received
-				uint8_t received_ack = 0;
-				uint8_t pend_send_retries = PEND_SEND_RETRIES_MAX;
-				gateway_protocol_packet_encode(
-					&(req->gch.gwp_conf),
-					GATEWAY_PROTOCOL_PACKET_TYPE_PEND_SEND,
-					payload_length, payload,
-					&(req->packet_length), req->packet);
-				do {
-					send_gcom_ch(&(req->gch), req->packet, req->packet_length);
-					
-					// 300 ms
-					usleep(300000);
-
-					pthread_mutex_lock(&mutex);
-					res = PQexec(conn, db_query);
-					pthread_mutex_unlock(&mutex);
-					
-					if (PQresultStatus(res) == PGRES_TUPLES_OK) {
-						if (!PQntuples(res) || strcmp(PQgetvalue(res, 0, 2), msg_cont)) {
-							received_ack = 1;
-						}
-					}
-					PQclear(res);
-					printf("received_ack = %d, retries = %d\n", received_ack, pend_send_retries);
-				} while (!received_ack && pend_send_retries--);
-			} else {
-				gateway_protocol_mk_stat(
-					&(req->gch),
-					GATEWAY_PROTOCOL_STAT_NACK,
-					req->packet, &(req->packet_length));
-				
-				send_gcom_ch(&(req->gch), req->packet, req->packet_length);
-				
-				printf("nothing for app %s dev %d\n", (char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
-			}
-		} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_STAT) {
-			// TODO change to ACK_PEND = 0x01
-			if (payload[0] == 0x00) {
-				char db_query[200];
-				snprintf(db_query, sizeof(db_query),
-					 "SELECT * FROM pend_msgs WHERE app_key = '%s' AND dev_id = %d AND ack = False", 
-					(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
-				);
-				pthread_mutex_lock(&mutex);
-				res = PQexec(conn, db_query);
-				pthread_mutex_unlock(&mutex);
-				if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
-					snprintf(db_query, sizeof(db_query),
-						"UPDATE pend_msgs SET ack = True WHERE app_key = '%s' AND dev_id = %d AND msg = '%s'",
-						(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id, PQgetvalue(res, 0, 2)
-					);
-					PQclear(res);
-					pthread_mutex_lock(&mutex);
-					res = PQexec(conn, db_query);
-					pthread_mutex_unlock(&mutex);
-					if (PQresultStatus(res) == PGRES_COMMAND_OK) {
-						printf("pend_msgs updated\n");
-					} else {
-						gw_stat.errors_count++;
-						fprintf(stderr, "database error : %s\n", PQerrorMessage(conn));
-					}
-				}
-				PQclear(res);
-			}
-		} else {
-			gateway_protocol_mk_stat(
-				&(req->gch),
-				GATEWAY_PROTOCOL_STAT_NACK,
-				req->packet, &(req->packet_length));
-			
-			send_gcom_ch(&(req->gch), req->packet, req->packet_length);
-				
-			fprintf(stderr, "packet type error : %02X\n", req->packet_type);
-			gw_stat.errors_count++;
-		}
-	} else {
 		fprintf(stderr, "payload decode error\n");
 		gw_stat.errors_count++;
+		gcom_ch_shutdown(&req->gch); // the connection ends with the request
+		gcom_ch_request_free(req);
+		return TASK_STAGE_DONE;
 	}
-		
-	close(req->gch.client_desc);
-	free(req);
-}
-
-uint8_t gateway_auth(const gw_conf_t *gw_conf, const char *dynamic_conf_file_path) {
-	int sockfd;
-	struct sockaddr_in platformaddr;
-	uint8_t buffer[1024];
-	uint16_t buffer_length = 0;
-	uint8_t payload_buffer[1024];
-	uint16_t payload_buffer_length = 0;
-	FILE *fp;
-
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		return 0;
+	req->packet_type 	= view.packet_type;
+	req->payload 		= view.payload;
+	req->payload_length 	= view.payload_length;
+
+	/* bulk uplink inserts wait behind time sync, acks and downlinks */
+	task_job_attr_init(tj_attr);
+	if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND ||
+	    req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND_MULTI) {
+		tj_attr->prio = TASK_QUEUE_PRIO_LOW;
+	} else {
+		tj_attr->prio = TASK_QUEUE_PRIO_HIGH;
 	}
 
-	memset(&platformaddr, 0x0, sizeof(platformaddr));
-
-	platformaddr.sin_family = AF_INET;
-	platformaddr.sin_addr.s_addr = inet_addr(gw_conf->static_conf.platform_gw_manager_ip);
-	platformaddr.sin_port = htons(gw_conf->static_conf.platform_gw_manager_port);
-	
-	if (connect(sockfd, (struct sockaddr *)&platformaddr, sizeof(platformaddr))) {
-		return 0;
+	/* readings of a device are stored in order, its pending message is
+	 * sent by one request at a time and acked after it was sent */
+	if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND ||
+	    req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND_MULTI ||
+	    req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_PEND_REQ ||
+	    req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_STAT) {
+		tj_attr->key = gcom_ch_request_key(req);
 	}
 
-	gateway_telemetry_protocol_encode_packet(buffer, 0, GATEWAY_TELEMETRY_PROTOCOL_AUTH, buffer, &buffer_length);
-	write(sockfd, buffer, buffer_length);
-	
-	buffer_length = read(sockfd, buffer, sizeof(buffer));
-	gateway_telemetry_protocol_packet_type_t pt;
-	if (!gateway_telemetry_protocol_decode_packet(payload_buffer, &payload_buffer_length, &pt, buffer, buffer_length)) {
-		return 0;
+	/* applications share each lane of the request stage by their weight */
+	tj_attr->flow = gcom_app_flow((const char *)req->gch.gwp_conf.app_key);
+
+	/* how long a device waits for the answer depends on what it asked */
+	switch (req->packet_type) {
+	case GATEWAY_PROTOCOL_PACKET_TYPE_TIME_REQ:
+		tj_attr->deadline_ns = gcom_ch_request_deadline(req, gw_static_conf->deadline_time_req_ms);
+		break;
+	case GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND:
+	case GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND_MULTI:
+		tj_attr->deadline_ns = gcom_ch_request_deadline(req, gw_static_conf->deadline_data_send_ms);
+		break;
+	case GATEWAY_PROTOCOL_PACKET_TYPE_PEND_REQ:
+		tj_attr->deadline_ns = gcom_ch_request_deadline(req, gw_static_conf->deadline_pend_req_ms);
+		break;
+	case GATEWAY_PROTOCOL_PACKET_TYPE_STAT:
+		tj_attr->deadline_ns = gcom_ch_request_deadline(req, gw_static_conf->deadline_stat_ms);
+		break;
+	default:
+		tj_attr->deadline_ns = req->deadline_ns;
+		break;
 	}
 
-	// write db_conf into file
-	fp = fopen(dynamic_conf_file_path, "w");
-	fwrite(payload_buffer, payload_buffer_length, 1, fp);
-	fclose(fp);
+	if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND && data_batch_max > 1) {
+		return GATEWAY_STAGE_DATA;
+	}
 
-	return 1;
+	return GATEWAY_STAGE_REQUEST;
 }
 
-#define GW_MNGR_BUF_LEN		1024
-#define GW_MNGR_QBUF_LEN	1136
-void * gateway_mngr(void *gw_cnf) {
-	struct itimerval tval;
-	gw_conf_t *gw_conf = (gw_conf_t *) gw_cnf;
-	sigset_t alarm_msk;
-	int sig;
-	struct timeval tv;
-	char buf[GW_MNGR_BUF_LEN];
-	char qbuf[GW_MNGR_QBUF_LEN];
-	char b64_gwid[12];
-	PGresult *res;
-	
-
-	sigemptyset(&alarm_msk);
-	sigaddset(&alarm_msk, SIGALRM);
+void gcom_ch_request_submit(gcom_ch_request_t *req) {
+	task_job_attr_t tj_attr;
 
-	tval.it_value.tv_sec = gw_conf->dynamic_conf.telemetry_send_period;
-	tval.it_value.tv_usec = 0;
-	tval.it_interval.tv_sec = gw_conf->dynamic_conf.telemetry_send_period;
-	tval.it_interval.tv_usec = 0;
+	task_job_attr_init(&tj_attr);
+	/* decoding is cheap and tells control packets from bulk ones */
+	tj_attr.prio = TASK_QUEUE_PRIO_HIGH;
 
-	if (setitimer(ITIMER_REAL, &tval, NULL)) {
-		perror("Failed to set itimer");
-		return NULL;
+	req->recv_ns = task_queue_now_ns();
+	tj_attr.deadline_ns = gcom_ch_request_deadline(req, gw_static_conf->deadline_decode_ms);
+	if (gw_static_conf->task_queue_dispatch_hash) {
+		tj_attr.hint = gcom_ch_request_hint(req);
 	}
+	if (task_pipeline_submit(pipeline, req, &tj_attr) < 0) {
+		fprintf(stderr, "task_pipeline submit error\n");
+		gcom_ch_request_shed(req, 0);
+	}
+}
 
-	base64_encode(gw_conf->static_conf.gw_id, GATEWAY_ID_SIZE, b64_gwid);
-	
-	while (1) {
-		// get utc
-		gettimeofday(&tv, NULL);
-
-		// create applications and devices serving log
-		pthread_mutex_lock(&gw_stat_mutex);
-		gw_stat_linked_list_flush(buf, 0);
-		pthread_mutex_unlock(&gw_stat_mutex);
+void process_drop(void *request, int stage) {
+	gcom_ch_request_t *req = (gcom_ch_request_t *)request;
 
-		// flush utc and log into a query	
-		snprintf(qbuf, GW_MNGR_QBUF_LEN, "UPDATE gateways SET num_errors = %lld, last_keep_alive = %d, last_report = '%s' WHERE id = '%s'",
-				gw_stat.errors_count, (uint32_t) tv.tv_sec, buf, b64_gwid );
+	/* expired, the client has given up and gets no answer */
+	if (req->deadline_ns && task_queue_now_ns() > req->deadline_ns) {
+		gcom_ch_request_free(req);
+		return;
+	}
 
-		pthread_mutex_lock(&mutex);
-		res = PQexec(conn, qbuf);
-		pthread_mutex_unlock(&mutex);
-	
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-			fprintf(stderr, "gateway manager db update failed!\n");
-		}
+	gcom_ch_request_shed(req, stage != GATEWAY_STAGE_DECODE);
+}
 
-		buf[0] = '\0';
-		qbuf[0] = '\0';
-		sigwait(&alarm_msk, &sig);
+/* Answers a request the queue has no room for. Decoded requests get a NACK,
+ * undecoded ones only have their connection closed: the app secure key is
+ * not known yet and looking it up is what the queue is waiting on.
+ */
+void gcom_ch_request_shed(gcom_ch_request_t *req, uint8_t decoded) {
+	if (decoded) {
+		gateway_protocol_mk_stat(
+			&(req->gch),
+			GATEWAY_PROTOCOL_STAT_NACK,
+			req->packet, &(req->packet_length));
+
+		send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+	} else {
+		gcom_ch_shutdown(&req->gch);
 	}
+
+	gcom_ch_request_free(req);
 }
 
-void gateway_protocol_data_send_payload_decode(
-	sensor_data_t *sensor_data, 
-	const uint8_t *payload, 
-	const uint8_t payload_length) 
-{
-	uint8_t p_len = 0;
+/* the PEND_SEND of msg into req->packet, msg is kept to tell its ack */
+void gcom_ch_request_mk_pend(gcom_ch_request_t *req, const char *msg) {
+	uint8_t pend_payload[DEVICE_DATA_MAX_LENGTH];
+	uint16_t payload_length;
 
-	memcpy(&sensor_data->utc, &payload[p_len], sizeof(sensor_data->utc));
-	p_len += sizeof(sensor_data->utc);
+	strncpy(req->msg_cont, msg, sizeof(req->msg_cont) - 1);
+	req->msg_cont[sizeof(req->msg_cont) - 1] = '\0';
+	printf("PEND_SEND prepared : %s\n", req->msg_cont);
 
-	memcpy(sensor_data->data, &payload[p_len], payload_length - p_len);
-	sensor_data->data_length = payload_length - p_len;
-}
+	base64_decode(req->msg_cont, strlen(req->msg_cont)-1, pend_payload);
+	payload_length = BASE64_DECODE_OUT_SIZE(strlen(req->msg_cont));
+	printf("prepared to send %d bytes : %s\n", payload_length, pend_payload);
 
-void gateway_protocol_mk_stat(
-	gcom_ch_t *gch,
-	gateway_protocol_stat_t stat,
-	uint8_t *pck,
-	uint8_t *pck_len)
-{
 	gateway_protocol_packet_encode(
-		&(gch->gwp_conf),
-		GATEWAY_PROTOCOL_PACKET_TYPE_STAT,
-		1, (uint8_t *)&stat,
-		pck_len, pck);
+		&(req->gch.gwp_conf),
+		GATEWAY_PROTOCOL_PACKET_TYPE_PEND_SEND,
+		payload_length, pend_payload,
+		&(req->packet_length), req->packet);
 }
 
+/* The PEND_SEND in req->packet was sent, it is sent again until its ack
+ * is received, 300 ms apart. Returns 0 once req is with the pend stage.
+ */
+int gcom_ch_request_pend(gcom_ch_request_t *req, task_job_attr_t *tj_attr) {
+	req->pend_send_retries = PEND_SEND_RETRIES_MAX;
+	req->deadline_ns = 0; // the device is listening
+	if (tj_attr) {
+		tj_attr->deadline_ns = 0;
+	}
 
-
-void send_utc(gcom_ch_t *gch) {
-	uint8_t buf[50];
-	uint8_t buf_len = 0;
-	struct timeval tv;
-				
-	gettimeofday(&tv, NULL);
-				
-	gateway_protocol_packet_encode (
-		&(gch->gwp_conf),
-		GATEWAY_PROTOCOL_PACKET_TYPE_TIME_SEND,
-		sizeof(uint32_t), (uint8_t *)&tv.tv_sec,
-		&buf_len, buf
-	);
-					
-	send_gcom_ch(gch, buf, buf_len);
+	return task_pipeline_submit_delayed(pipeline, GATEWAY_STAGE_PEND, req, tj_attr, PEND_SEND_RETRY_MS);
 }
 
-void gateway_protocol_checkup_callback(gateway_protocol_conf_t *gwp_conf) {
+/* Answers stored readings with ACK, or ACK_PEND if a message waits for
+ * the device. With downlink_coalesce, the message and the time when a
+ * reading had none go with the ack instead of a round trip of their own.
+ * Returns 0 once req is with the pend stage, req->packet is overwritten.
+ */
+int gcom_ch_request_ack(gcom_ch_request_t *req, task_job_attr_t *tj_attr, uint8_t time_unset) {
+	uint8_t frames[GATEWAY_REPLY_FRAMES - 1][DEVICE_DATA_MAX_LENGTH];
+	uint16_t frame_length;
+	struct iovec iov[GATEWAY_REPLY_FRAMES];
+	int iov_num = 0, pending;
 	PGresult *res;
 	char db_query[200];
-	
-	snprintf(db_query, sizeof(db_query), 
-		"SELECT secure_key, secure FROM applications WHERE app_key = '%s'", (char *)gwp_conf->app_key
-	);
-	pthread_mutex_lock(&mutex);
-	res = PQexec(conn, db_query);
-	pthread_mutex_unlock(&mutex);
 
-	if ((PQresultStatus(res) == PGRES_TUPLES_OK) && PQntuples(res)) {
-		base64_decode(PQgetvalue(res, 0, 0), strlen(PQgetvalue(res, 0, 0))-1, gwp_conf->secure_key);
-		gwp_conf->secure = PQgetvalue(res, 0, 1)[0] == 't';
+	snprintf(db_query, sizeof(db_query),
+		 "SELECT * FROM pend_msgs WHERE app_key='%s' and dev_id = %d and ack = False", 
+		(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
+	);
+	
+	res = db_exec(db_query);
+	pending = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res);
+	
+	if (pending) {
+		gateway_protocol_mk_stat(
+			&(req->gch), 
+			GATEWAY_PROTOCOL_STAT_ACK_PEND,
+			frames[0], &frame_length);
+		printf("ACK_PEND prepared\n");
 	} else {
-		perror("gateway_protocol_checkup_callback error");
+		gateway_protocol_mk_stat(
+			&(req->gch), 
+			GATEWAY_PROTOCOL_STAT_ACK,
+			frames[0], &frame_length);
+		printf("ACK prepared\n");
+	}
+	iov[iov_num].iov_base 	= frames[0];
+	iov[iov_num++].iov_len 	= frame_length;
+
+	if (gw_static_conf->downlink_coalesce) {
+		if (pending) {
+			gcom_ch_request_mk_pend(req, PQgetvalue(res, 0, 2));
+			iov[iov_num].iov_base 	= req->packet;
+			iov[iov_num++].iov_len 	= req->packet_length;
+		}
+		if (time_unset) {
+			gateway_protocol_mk_utc(&(req->gch), frames[1], &frame_length);
+			iov[iov_num].iov_base 	= frames[1];
+			iov[iov_num++].iov_len 	= frame_length;
+		}
+	} else {
+		pending = 0;
+	}
+	PQclear(res);
+	
+	send_gcom_ch_iov(&(req->gch), iov, iov_num);
+
+	return !pending || gcom_ch_request_pend(req, tj_attr);
+}
+
+int process_request(void *request, task_job_attr_t *tj_attr) {
+	gcom_ch_request_t *req = (gcom_ch_request_t *)request;
+	const uint8_t *payload = req->payload;
+	PGresult *res;
+
+	if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_TIME_REQ) {
+		printf("TIME REQ received\n");
+		send_utc(&(req->gch));
+	} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND) {
+		sensor_data_t sensor_data;
+		time_t t;
+		// DEVICE_DATA_MAX_LENGTH*2 {hex} + 150
+		char db_query[662];
+
+		printf("DATA SEND received\n");
+		if (!gateway_protocol_data_send_payload_view(&sensor_data, payload, req->payload_length)) {
+			gateway_protocol_mk_stat(
+				&(req->gch),
+				GATEWAY_PROTOCOL_STAT_NACK,
+				req->packet, &(req->packet_length));
+			send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+
+			fprintf(stderr, "payload decode error\n");
+			gw_stat.errors_count++;
+			gcom_ch_request_free(req);
+			return TASK_STAGE_DONE;
+		}
+		
+		if (sensor_data.utc == 0) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			t = tv.tv_sec;
+		} else {
+			t = sensor_data.utc;
+		}
+		
+		strftime(sensor_data.timedate, TIMEDATE_LENGTH, "%d/%m/%Y %H:%M:%S", localtime(&t));
+		snprintf(db_query, sizeof(db_query), 
+			"INSERT INTO dev_%s_%d VALUES (%lu, '%s', $1)", 
+			(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id, t, sensor_data.timedate
+		);
+		
+		const char *params[1];
+		int paramslen[1];
+		int paramsfor[1];
+		params[0] = (char *) sensor_data.data;
+		paramslen[0] = sensor_data.data_length;
+		paramsfor[0] = 1; // format - binary
+
+		pthread_mutex_lock(&gw_stat_mutex);
+		gw_stat_linked_list_add((char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
+		pthread_mutex_unlock(&gw_stat_mutex);
+
+		res = db_exec_params(db_query, 1, params, paramslen, paramsfor);
+
+		if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+			PQclear(res);
+			if (!gcom_ch_request_ack(req, tj_attr, sensor_data.utc == 0)) {
+				return TASK_STAGE_DONE;
+			}
+		} else {
+			fprintf(stderr, "database error : %s\n", PQerrorMessage(conn));
+			gw_stat.errors_count++;
+			PQclear(res);
+		}
+	} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_DATA_SEND_MULTI) {
+		return process_data_records(req, tj_attr);
+	} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_PEND_REQ) {
+		char db_query[200];
+		snprintf(db_query, sizeof(db_query),
+			 "SELECT * FROM pend_msgs WHERE app_key = '%s' AND dev_id = %d AND ack = False", 
+			(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
+		);
+		res = db_exec(db_query);
+		
+		if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
+			gcom_ch_request_mk_pend(req, PQgetvalue(res, 0, 2));
+			PQclear(res);
+
+			send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+
+			if (!gcom_ch_request_pend(req, tj_attr)) {
+				return TASK_STAGE_DONE;
+			}
+		} else {
+			gateway_protocol_mk_stat(
+				&(req->gch),
+				GATEWAY_PROTOCOL_STAT_NACK,
+				req->packet, &(req->packet_length));
+			
+			send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+			
+			printf("nothing for app %s dev %d\n", (char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
+		}
+	} else if (req->packet_type == GATEWAY_PROTOCOL_PACKET_TYPE_STAT) {
+		// TODO change to ACK_PEND = 0x01
+		if (payload[0] == 0x00) {
+			char db_query[200];
+			snprintf(db_query, sizeof(db_query),
+				 "SELECT * FROM pend_msgs WHERE app_key = '%s' AND dev_id = %d AND ack = False", 
+				(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
+			);
+			res = db_exec(db_query);
+			if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
+				snprintf(db_query, sizeof(db_query),
+					"UPDATE pend_msgs SET ack = True WHERE app_key = '%s' AND dev_id = %d AND msg = '%s'",
+					(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id, PQgetvalue(res, 0, 2)
+				);
+				PQclear(res);
+				res = db_exec(db_query);
+				if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+					printf("pend_msgs updated\n");
+				} else {
+					gw_stat.errors_count++;
+					fprintf(stderr, "database error : %s\n", PQerrorMessage(conn));
+				}
+			}
+			PQclear(res);
+		}
+	} else {
+		gateway_protocol_mk_stat(
+			&(req->gch),
+			GATEWAY_PROTOCOL_STAT_NACK,
+			req->packet, &(req->packet_length));
+		
+		send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+			
+		fprintf(stderr, "packet type error : %02X\n", req->packet_type);
+		gw_stat.errors_count++;
+	}
+		
+	gcom_ch_request_free(req);
+
+	return TASK_STAGE_DONE;
+}
+
+/* Stores the readings of a DATA_SEND_MULTI, buffered by a device while
+ * it was offline, with one multi-row insert, and acks them as one. The
+ * records are checked first so that a malformed packet stores nothing.
+ */
+int process_data_records(gcom_ch_request_t *req, task_job_attr_t *tj_attr) {
+	sensor_data_t sensor_data;
+	PGresult *res;
+	time_t t;
+	const char **params = NULL;
+	int *paramslen = NULL, *paramsfor = NULL;
+	char *db_query = NULL;
+	size_t len, query_size;
+	uint16_t offset = 0;
+	uint8_t time_unset = 0;
+	int i, records = 0;
+
+	printf("DATA SEND MULTI received\n");
+
+	while (offset < req->payload_length) {
+		if (!gateway_protocol_data_record_view(&sensor_data, req->payload, req->payload_length, &offset)) {
+			records = 0;
+			break;
+		}
+		records++;
+	}
+
+	// "(utc, 'timedate', $n)" per record
+	query_size = records * (TIMEDATE_LENGTH + 40) + 100;
+	if (records) {
+		db_query 	= (char *)malloc(query_size);
+		params 		= (const char **)malloc(records * sizeof(*params));
+		paramslen 	= (int *)malloc(records * sizeof(*paramslen));
+		paramsfor 	= (int *)malloc(records * sizeof(*paramsfor));
+	}
+	if (!db_query || !params || !paramslen || !paramsfor) {
+		gateway_protocol_mk_stat(
+			&(req->gch),
+			GATEWAY_PROTOCOL_STAT_NACK,
+			req->packet, &(req->packet_length));
+		send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+
+		fprintf(stderr, records ? "records allocation error\n" : "payload decode error\n");
+		gw_stat.errors_count++;
+		free(db_query);
+		free(params);
+		free(paramslen);
+		free(paramsfor);
+		gcom_ch_request_free(req);
+		return TASK_STAGE_DONE;
+	}
+
+	len = snprintf(db_query, query_size, "INSERT INTO dev_%s_%d VALUES ",
+		(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
+	for (i = 0, offset = 0; i < records; i++) {
+		gateway_protocol_data_record_view(&sensor_data, req->payload, req->payload_length, &offset);
+
+		if (sensor_data.utc == 0) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			t = tv.tv_sec;
+			time_unset = 1;
+		} else {
+			t = sensor_data.utc;
+		}
+		strftime(sensor_data.timedate, TIMEDATE_LENGTH, "%d/%m/%Y %H:%M:%S", localtime(&t));
+
+		len += snprintf(db_query + len, query_size - len, "%s(%lu, '%s', $%d)",
+			i ? ", " : "", t, sensor_data.timedate, i + 1);
+		params[i] 	= (const char *)sensor_data.data;
+		paramslen[i] 	= sensor_data.data_length;
+		paramsfor[i] 	= 1; // format - binary
+	}
+
+	pthread_mutex_lock(&gw_stat_mutex);
+	gw_stat_linked_list_add((char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id);
+	pthread_mutex_unlock(&gw_stat_mutex);
+
+	res = db_exec_params(db_query, records, params, paramslen, paramsfor);
+	free(db_query);
+	free(params);
+	free(paramslen);
+	free(paramsfor);
+
+	if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+		PQclear(res);
+		printf("%d records stored\n", records);
+		if (!gcom_ch_request_ack(req, tj_attr, time_unset)) {
+			return TASK_STAGE_DONE;
+		}
+	} else {
+		fprintf(stderr, "database error : %s\n", PQerrorMessage(conn));
+		gw_stat.errors_count++;
+		PQclear(res);
+	}
+
+	gcom_ch_request_free(req);
+
+	return TASK_STAGE_DONE;
+}
+
+/* Polls pend_msgs for the ack of a PEND_SEND. The worker is not held
+ * between tries: every retry is a job of its own queued by the timers
+ * of the request queue once PEND_SEND_RETRY_MS have elapsed.
+ */
+int process_pend_retry(void *request, task_job_attr_t *tj_attr) {
+	gcom_ch_request_t *req = (gcom_ch_request_t *)request;
+	uint8_t received_ack = 0;
+	PGresult *res;
+	char db_query[200];
+
+	snprintf(db_query, sizeof(db_query),
+		 "SELECT * FROM pend_msgs WHERE app_key = '%s' AND dev_id = %d AND ack = False", 
+		(char *)req->gch.gwp_conf.app_key, req->gch.gwp_conf.dev_id
+	);
+	res = db_exec(db_query);
+	
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		if (!PQntuples(res) || strcmp(PQgetvalue(res, 0, 2), req->msg_cont)) {
+			received_ack = 1;
+		}
+	}
+	PQclear(res);
+	printf("received_ack = %d, retries = %d\n", received_ack, req->pend_send_retries);
+
+	if (!received_ack && req->pend_send_retries--) {
+		send_gcom_ch(&(req->gch), req->packet, req->packet_length);
+		if (!task_pipeline_submit_delayed(pipeline, GATEWAY_STAGE_PEND, req, tj_attr, PEND_SEND_RETRY_MS)) {
+			return TASK_STAGE_DONE;
+		}
+	}
+
+	gcom_ch_request_free(req);
+
+	return TASK_STAGE_DONE;
+}
+
+/* Stores up to task_queue_batch_max DATA_SEND readings with one round trip
+ * for the inserts and one for the pending messages lookup. If the batch
+ * fails as a whole every request goes through process_request on its own.
+ * With downlink_coalesce, a pending message goes with the first ack of its
+ * device in the batch.
+ */
+void process_data_batch(void **requests, int count) {
+	gcom_ch_request_t **reqs = (gcom_ch_request_t **)requests;
+	sensor_data_t sensor_data;
+	PGresult *res;
+	time_t t;
+	size_t len, query_size;
+	char *db_query, *pushed = NULL;
+	int i, j, ok = 0;
+	uint16_t k;
+
+	if (count == 1) {
+		process_request(reqs[0], NULL);
+		return;
+	}
+
+	printf("DATA SEND batch of %d received\n", count);
+
+	// payload*2 {hex} + 150 per statement
+	query_size = 100;
+	for (i = 0; i < count; i++) {
+		query_size += reqs[i]->payload_length * 2 + 150;
+	}
+	db_query = (char *)malloc(query_size);
+
+	if (db_query) {
+		len = 0;
+		for (i = 0; i < count && len < query_size; i++) {
+			if (!gateway_protocol_data_send_payload_view(&sensor_data, reqs[i]->payload, reqs[i]->payload_length)) {
+				break; // answered one by one
+			}
+
+			if (sensor_data.utc == 0) {
+				struct timeval tv;
+				gettimeofday(&tv, NULL);
+				t = tv.tv_sec;
+			} else {
+				t = sensor_data.utc;
+			}
+			strftime(sensor_data.timedate, TIMEDATE_LENGTH, "%d/%m/%Y %H:%M:%S", localtime(&t));
+
+			// bytea in hex, escaped without the connection
+			len += snprintf(db_query + len, query_size - len,
+				"INSERT INTO dev_%s_%d VALUES (%lu, '%s', E'\\\\x",
+				(char *)reqs[i]->gch.gwp_conf.app_key, reqs[i]->gch.gwp_conf.dev_id, t, sensor_data.timedate
+			);
+			for (k = 0; k < sensor_data.data_length && len < query_size; k++) {
+				len += snprintf(db_query + len, query_size - len, "%02x", sensor_data.data[k]);
+			}
+			if (len < query_size) {
+				len += snprintf(db_query + len, query_size - len, "');");
+			}
+		}
+
+		/* a multi statement query runs as a single transaction */
+		if (i == count && len < query_size) {
+			res = db_exec(db_query);
+			ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+			if (!ok) {
+				fprintf(stderr, "database batch error : %s\n", PQresultErrorMessage(res));
+			}
+			PQclear(res);
+		}
+	}
+
+	if (!ok) {
+		free(db_query);
+		for (i = 0; i < count; i++) {
+			process_request(reqs[i], NULL);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&gw_stat_mutex);
+	for (i = 0; i < count; i++) {
+		gw_stat_linked_list_add((char *)reqs[i]->gch.gwp_conf.app_key, reqs[i]->gch.gwp_conf.dev_id);
+	}
+	pthread_mutex_unlock(&gw_stat_mutex);
+
+	len = snprintf(db_query, query_size,
+		"SELECT DISTINCT ON (app_key, dev_id) app_key, dev_id, msg FROM pend_msgs WHERE ack = False AND (");
+	for (i = 0; i < count; i++) {
+		len += snprintf(db_query + len, query_size - len,
+			"%s(app_key = '%s' AND dev_id = %d)", i ? " OR " : "",
+			(char *)reqs[i]->gch.gwp_conf.app_key, reqs[i]->gch.gwp_conf.dev_id
+		);
+	}
+	snprintf(db_query + len, query_size - len, ")");
+
+	res = db_exec(db_query);
+	free(db_query);
+
+	if (gw_static_conf->downlink_coalesce && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
+		pushed = (char *)calloc(PQntuples(res), 1);
+	}
+
+	for (i = 0; i < count; i++) {
+		gateway_protocol_stat_t stat = GATEWAY_PROTOCOL_STAT_ACK;
+		uint8_t frames[GATEWAY_REPLY_FRAMES - 1][DEVICE_DATA_MAX_LENGTH];
+		uint16_t frame_length;
+		struct iovec iov[GATEWAY_REPLY_FRAMES];
+		int iov_num = 0, pending = 0, pend_row = -1;
+
+		if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+			for (j = 0; j < PQntuples(res); j++) {
+				if (!strcmp(PQgetvalue(res, j, 0), (char *)reqs[i]->gch.gwp_conf.app_key) &&
+				    atoi(PQgetvalue(res, j, 1)) == reqs[i]->gch.gwp_conf.dev_id) {
+					stat = GATEWAY_PROTOCOL_STAT_ACK_PEND;
+					pend_row = j;
+					break;
+				}
+			}
+		}
+
+		gateway_protocol_mk_stat(
+			&(reqs[i]->gch),
+			stat,
+			frames[0], &frame_length);
+		iov[iov_num].iov_base 	= frames[0];
+		iov[iov_num++].iov_len 	= frame_length;
+
+		if (gw_static_conf->downlink_coalesce) {
+			gateway_protocol_data_send_payload_view(&sensor_data, reqs[i]->payload, reqs[i]->payload_length);
+			if (pushed && pend_row >= 0 && !pushed[pend_row]) {
+				pushed[pend_row] = pending = 1;
+				gcom_ch_request_mk_pend(reqs[i], PQgetvalue(res, pend_row, 2));
+				iov[iov_num].iov_base 	= reqs[i]->packet;
+				iov[iov_num++].iov_len 	= reqs[i]->packet_length;
+			}
+			if (sensor_data.utc == 0) {
+				gateway_protocol_mk_utc(&(reqs[i]->gch), frames[1], &frame_length);
+				iov[iov_num].iov_base 	= frames[1];
+				iov[iov_num++].iov_len 	= frame_length;
+			}
+		}
+
+		send_gcom_ch_iov(&(reqs[i]->gch), iov, iov_num);
+
+		if (!pending || gcom_ch_request_pend(reqs[i], NULL)) {
+			gcom_ch_request_free(reqs[i]);
+		}
+	}
+	free(pushed);
+	PQclear(res);
+}
+
+PGresult * db_exec(const char *query) {
+	return db_exec_params(query, 0, NULL, NULL, NULL);
+}
+
+/* Runs a query of a request on the shared connection. Its round trip,
+ * wait for the connection included, drives the concurrency limit of the
+ * request stage. The queries queue on the connection, so the running
+ * requests tell whether the limit is used.
+ */
+PGresult * db_exec_params(const char *query, int n_params, const char * const *values, const int *lengths, const int *formats) {
+	task_queue_t *tq = NULL;
+	task_queue_stats_t stats;
+	PGresult *res;
+	uint64_t start = 0;
+
+	if (db_limit) {
+		start = conc_limit_start(db_limit);
+	}
+
+	pthread_mutex_lock(&mutex);
+	if (n_params) {
+		res = PQexecParams(conn, query, n_params, NULL, values, lengths, formats, 0);
+	} else {
+		res = PQexec(conn, query);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (db_limit) {
+		tq = task_pipeline_get_queue(pipeline, GATEWAY_STAGE_REQUEST);
+		task_queue_get_stats(tq, &stats);
+		conc_limit_busy(db_limit, stats.active_tasks);
+		if (conc_limit_end(db_limit, start)) {
+			task_queue_set_limit(tq, conc_limit_get(db_limit));
+		}
+	}
+
+	return res;
+}
+
+/* keeps packets of a device on the same worker: app_key is sent in clear,
+ * dev_id may be encrypted so the device address stands for it */
+int gcom_ch_request_hint(const gcom_ch_request_t *req) {
+	uint32_t h = 2166136261u; // FNV-1a
+	uint8_t i;
+
+	for (i = 0; i < GATEWAY_PROTOCOL_APP_KEY_SIZE && i < req->packet_length; i++) {
+		h = (h ^ req->packet[i]) * 16777619u;
+	}
+	for (i = 0; i < sizeof(req->gch.client.sin_addr.s_addr); i++) {
+		h = (h ^ ((uint8_t *)&req->gch.client.sin_addr.s_addr)[i]) * 16777619u;
+	}
+
+	return h & 0x7FFFFFFF;
+}
+
+/* (app_key, dev_id) of a decoded request */
+long gcom_ch_request_key(const gcom_ch_request_t *req) {
+	uint32_t h = 2166136261u; // FNV-1a
+	uint8_t i;
+
+	for (i = 0; i < GATEWAY_PROTOCOL_APPKEY_SIZE; i++) {
+		h = (h ^ req->gch.gwp_conf.app_key[i]) * 16777619u;
+	}
+	h = (h ^ req->gch.gwp_conf.dev_id) * 16777619u;
+
+	return h & 0x7FFFFFFF;
+}
+
+/* receive time plus budget_ms, 0 (no deadline) for a budget of 0 */
+uint64_t gcom_ch_request_deadline(gcom_ch_request_t *req, uint32_t budget_ms) {
+	req->deadline_ns = budget_ms ? req->recv_ns + (uint64_t)budget_ms * 1000000 : 0;
+
+	return req->deadline_ns;
+}
+
+/* flow of an application, from the app_key string as stored in the database */
+long gcom_app_flow(const char *app_key) {
+	uint32_t h = 2166136261u; // FNV-1a
+	uint8_t i;
+
+	for (i = 0; i < GATEWAY_PROTOCOL_APPKEY_SIZE && app_key[i]; i++) {
+		h = (h ^ (uint8_t)app_key[i]) * 16777619u;
+	}
+
+	return h & 0x7FFFFFFF;
+}
+
+uint32_t gcom_app_key_hash(const uint8_t *app_key) {
+	uint32_t h = 2166136261u; // FNV-1a
+	uint8_t i;
+
+	for (i = 0; i < GATEWAY_PROTOCOL_APPKEY_SIZE; i++) {
+		h = (h ^ app_key[i]) * 16777619u;
+	}
+
+	return h % GATEWAY_APP_KEY_BUCKETS;
+}
+
+/* Keys of the applications for the receiver, then their weights. The
+ * keys come from the columns the checkup callback reads, so that framing
+ * does not depend on the weights.
+ */
+void gateway_apps_load(void) {
+	gcom_app_key_t *keys[GATEWAY_APP_KEY_BUCKETS] = { NULL };
+	gcom_app_key_t *ak, *next;
+	uint8_t secure_key[GATEWAY_PROTOCOL_SECURE_KEY_SIZE];
+	const char *value;
+	PGresult *res;
+	uint32_t h;
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	res = PQexec(conn, "SELECT app_key, secure_key, secure FROM applications");
+	pthread_mutex_unlock(&mutex);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		fprintf(stderr, "applications load error : %s\n", PQerrorMessage(conn));
+		PQclear(res);
+		gateway_flow_weights_load();
+		return;
+	}
+
+	for (i = 0; i < PQntuples(res); i++) {
+		if (PQgetlength(res, i, 0) != GATEWAY_PROTOCOL_APPKEY_SIZE || !(ak = (gcom_app_key_t *)malloc(sizeof(gcom_app_key_t)))) {
+			continue;
+		}
+		memcpy(ak->app_key, PQgetvalue(res, i, 0), GATEWAY_PROTOCOL_APPKEY_SIZE);
+		ak->secure = PQgetvalue(res, i, 2)[0] == 't';
+		if (ak->secure) {
+			value = PQgetvalue(res, i, 1);
+			base64_decode(value, strlen(value)-1, secure_key);
+			AES_init_ctx(&ak->aes_ctx, secure_key);
+		}
+		h = gcom_app_key_hash(ak->app_key);
+		ak->next = keys[h];
+		keys[h] = ak;
+	}
+	PQclear(res);
+
+	/* the receiver sees either table whole */
+	pthread_mutex_lock(&app_keys_mutex);
+	for (h = 0; h < GATEWAY_APP_KEY_BUCKETS; h++) {
+		ak = app_keys[h];
+		app_keys[h] = keys[h];
+		keys[h] = ak;
+	}
+	pthread_mutex_unlock(&app_keys_mutex);
+
+	for (h = 0; h < GATEWAY_APP_KEY_BUCKETS; h++) {
+		for (ak = keys[h]; ak; ak = next) {
+			next = ak->next;
+			free(ak);
+		}
+	}
+
+	gateway_flow_weights_load();
+}
+
+/* Weights of the applications in the request stage queue. Applications
+ * without a row, or a weight below 1, keep the default of 1. The column is
+ * optional on the platform database :
+ *   ALTER TABLE applications ADD COLUMN IF NOT EXISTS weight integer NOT NULL DEFAULT 1;
+ * without it every application keeps the default.
+ */
+void gateway_flow_weights_load(void) {
+	task_queue_t *tq;
+	PGresult *res;
+	int i;
+
+	if (!pipeline) {
+		return; // the manager may run before the pipeline is created
+	}
+	tq = task_pipeline_get_queue(pipeline, GATEWAY_STAGE_REQUEST);
+
+	pthread_mutex_lock(&mutex);
+	res = PQexec(conn, "SELECT app_key, weight FROM applications");
+	pthread_mutex_unlock(&mutex);
+
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		for (i = 0; i < PQntuples(res); i++) {
+			if (!PQgetisnull(res, i, 1) && atoi(PQgetvalue(res, i, 1)) > 0) {
+				task_queue_set_flow_weight(tq, gcom_app_flow(PQgetvalue(res, i, 0)), atoi(PQgetvalue(res, i, 1)));
+			}
+		}
+	} else if (!PQresultErrorField(res, PG_DIAG_SQLSTATE) || strcmp(PQresultErrorField(res, PG_DIAG_SQLSTATE), "42703")) {
+		// 42703 undefined_column : no weight column, all weights stay 1
+		fprintf(stderr, "applications weights error : %s\n", PQerrorMessage(conn));
+	}
+	PQclear(res);
+}
+
+uint8_t gateway_auth(const gw_conf_t *gw_conf, const char *dynamic_conf_file_path) {
+	int sockfd;
+	struct sockaddr_in platformaddr;
+	uint8_t buffer[1024];
+	uint16_t buffer_length = 0;
+	uint8_t payload_buffer[1024];
+	uint16_t payload_buffer_length = 0;
+	FILE *fp;
+
+	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return 0;
+	}
+
+	memset(&platformaddr, 0x0, sizeof(platformaddr));
+
+	platformaddr.sin_family = AF_INET;
+	platformaddr.sin_addr.s_addr = inet_addr(gw_conf->static_conf.platform_gw_manager_ip);
+	platformaddr.sin_port = htons(gw_conf->static_conf.platform_gw_manager_port);
+	
+	if (connect(sockfd, (struct sockaddr *)&platformaddr, sizeof(platformaddr))) {
+		return 0;
+	}
+
+	gateway_telemetry_protocol_encode_packet(buffer, 0, GATEWAY_TELEMETRY_PROTOCOL_AUTH, buffer, &buffer_length);
+	write(sockfd, buffer, buffer_length);
+	
+	buffer_length = read(sockfd, buffer, sizeof(buffer));
+	gateway_telemetry_protocol_packet_type_t pt;
+	if (!gateway_telemetry_protocol_decode_packet(payload_buffer, &payload_buffer_length, &pt, buffer, buffer_length)) {
+		return 0;
+	}
+
+	// write db_conf into file
+	fp = fopen(dynamic_conf_file_path, "w");
+	fwrite(payload_buffer, payload_buffer_length, 1, fp);
+	fclose(fp);
+
+	return 1;
+}
+
+#define GW_MNGR_BUF_LEN		1024
+#define GW_MNGR_QBUF_LEN	1136
+void * gateway_mngr(void *gw_cnf) {
+	struct itimerval tval;
+	gw_conf_t *gw_conf = (gw_conf_t *) gw_cnf;
+	sigset_t alarm_msk;
+	int sig;
+	struct timeval tv;
+	char buf[GW_MNGR_BUF_LEN];
+	char qbuf[GW_MNGR_QBUF_LEN];
+	char b64_gwid[12];
+	PGresult *res;
+	task_queue_stats_t tq_stats;
+	task_queue_metrics_t tq_metrics;
+	conc_limit_stats_t cl_stats;
+	
+
+	sigemptyset(&alarm_msk);
+	sigaddset(&alarm_msk, SIGALRM);
+
+	tval.it_value.tv_sec = gw_conf->dynamic_conf.telemetry_send_period;
+	tval.it_value.tv_usec = 0;
+	tval.it_interval.tv_sec = gw_conf->dynamic_conf.telemetry_send_period;
+	tval.it_interval.tv_usec = 0;
+
+	if (setitimer(ITIMER_REAL, &tval, NULL)) {
+		perror("Failed to set itimer");
+		return NULL;
+	}
+
+	base64_encode(gw_conf->static_conf.gw_id, GATEWAY_ID_SIZE, b64_gwid);
+	
+	while (1) {
+		// get utc
+		gettimeofday(&tv, NULL);
+
+		// create applications and devices serving log
+		pthread_mutex_lock(&gw_stat_mutex);
+		gw_stat_linked_list_flush(buf, 0);
+		pthread_mutex_unlock(&gw_stat_mutex);
+
+		// flush utc and log into a query	
+		snprintf(qbuf, GW_MNGR_QBUF_LEN, "UPDATE gateways SET num_errors = %lld, last_keep_alive = %d, last_report = '%s' WHERE id = '%s'",
+				gw_stat.errors_count, (uint32_t) tv.tv_sec, buf, b64_gwid );
+
+		pthread_mutex_lock(&mutex);
+		res = PQexec(conn, qbuf);
+		pthread_mutex_unlock(&mutex);
+	
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			fprintf(stderr, "gateway manager db update failed!\n");
+		}
+
+		// applications changed on the platform apply from the next period
+		gateway_apps_load();
+
+		for (int i = 0; pipeline && i < GATEWAY_STAGE_NUM; i++) {
+			task_queue_t *tq = task_pipeline_get_queue(pipeline, i);
+			const char *name = task_pipeline_get_stage_name(pipeline, i);
+			int shared = 0;
+
+			for (int j = 0; j < i; j++) {
+				shared |= task_pipeline_get_queue(pipeline, j) == tq;
+			}
+			if (shared) {
+				continue;
+			}
+
+			task_queue_get_stats(tq, &tq_stats);
+			printf("%s stage : size %d delayed %d rejected %llu dropped %llu blocked %llu expired %llu\n",
+					name, tq_stats.size, tq_stats.delayed, tq_stats.rejected, tq_stats.dropped, tq_stats.blocked,
+					tq_stats.expired);
+
+			/* tells queueing delay from processing time */
+			task_queue_get_metrics(tq, &tq_metrics);
+			printf("%s stage : wait us p50 %llu p99 %llu max %llu, service us p50 %llu p99 %llu max %llu\n",
+					name,
+					task_queue_hist_percentile(&tq_metrics.wait, 0.5),
+					task_queue_hist_percentile(&tq_metrics.wait, 0.99),
+					tq_metrics.wait.max_us,
+					task_queue_hist_percentile(&tq_metrics.service, 0.5),
+					task_queue_hist_percentile(&tq_metrics.service, 0.99),
+					tq_metrics.service.max_us);
+			printf("%s stage : depth hwm %d pending hwm %d (high %d normal %d low %d), active workers %d/%d hwm %d\n",
+					name, tq_metrics.size_hwm, tq_metrics.pending_hwm,
+					tq_metrics.lane_pending_hwm[TASK_QUEUE_PRIO_HIGH],
+					tq_metrics.lane_pending_hwm[TASK_QUEUE_PRIO_NORMAL],
+					tq_metrics.lane_pending_hwm[TASK_QUEUE_PRIO_LOW],
+					tq_metrics.active_workers, tq_metrics.workers, tq_metrics.active_workers_hwm);
+			printf("%s stage : concurrency limit %d\n", name, tq_metrics.limit);
+		}
+
+		if (db_limit) {
+			conc_limit_get_stats(db_limit, &cl_stats);
+			printf("db : limit %d inflight %d rtt us %llu no load %llu\n",
+					cl_stats.limit, cl_stats.inflight, cl_stats.rtt_us, cl_stats.rtt_noload_us);
+		}
+
+		buf[0] = '\0';
+		qbuf[0] = '\0';
+		sigwait(&alarm_msk, &sig);
+	}
+}
+
+/* the reading is left in the payload, 0 if there is no room for the utc */
+uint8_t gateway_protocol_data_send_payload_view(
+	sensor_data_t *sensor_data, 
+	const uint8_t *payload, 
+	const uint16_t payload_length) 
+{
+	uint16_t p_len = 0;
+
+	if (payload_length < sizeof(sensor_data->utc)) {
+		return 0;
+	}
+
+	memcpy(&sensor_data->utc, &payload[p_len], sizeof(sensor_data->utc));
+	p_len += sizeof(sensor_data->utc);
+
+	sensor_data->data 	 = &payload[p_len];
+	sensor_data->data_length = payload_length - p_len;
+
+	return 1;
+}
+
+uint8_t gateway_protocol_data_record_view(
+	sensor_data_t *sensor_data, 
+	const uint8_t *payload, 
+	const uint16_t payload_length,
+	uint16_t *offset) 
+{
+	uint16_t p_len = *offset;
+
+	if (payload_length - p_len < GATEWAY_PROTOCOL_DATA_RECORD_HEADER_SIZE) {
+		return 0;
+	}
+
+	memcpy(&sensor_data->utc, &payload[p_len], sizeof(sensor_data->utc));
+	p_len += sizeof(sensor_data->utc);
+
+	sensor_data->data_length = payload[p_len];
+	p_len++;
+
+	if (payload_length - p_len < sensor_data->data_length) {
+		return 0;
+	}
+	sensor_data->data = &payload[p_len];
+	*offset = p_len + sensor_data->data_length;
+
+	return 1;
+}
+
+void gateway_protocol_mk_stat(
+	gcom_ch_t *gch,
+	gateway_protocol_stat_t stat,
+	uint8_t *pck,
+	uint16_t *pck_len)
+{
+	gateway_protocol_packet_encode(
+		&(gch->gwp_conf),
+		GATEWAY_PROTOCOL_PACKET_TYPE_STAT,
+		1, (uint8_t *)&stat,
+		pck_len, pck);
+}
+
+
+
+void gateway_protocol_mk_utc(
+	gcom_ch_t *gch,
+	uint8_t *pck,
+	uint16_t *pck_len)
+{
+	struct timeval tv;
+				
+	gettimeofday(&tv, NULL);
+				
+	gateway_protocol_packet_encode (
+		&(gch->gwp_conf),
+		GATEWAY_PROTOCOL_PACKET_TYPE_TIME_SEND,
+		sizeof(uint32_t), (uint8_t *)&tv.tv_sec,
+		pck_len, pck
+	);
+}
+
+void send_utc(gcom_ch_t *gch) {
+	uint8_t buf[50];
+	uint16_t buf_len = 0;
+
+	gateway_protocol_mk_utc(gch, buf, &buf_len);
+					
+	send_gcom_ch(gch, buf, buf_len);
+}
+
+void gateway_protocol_checkup_callback(gateway_protocol_conf_t *gwp_conf) {
+	PGresult *res;
+	char db_query[200];
+	
+	snprintf(db_query, sizeof(db_query), 
+		"SELECT secure_key, secure FROM applications WHERE app_key = '%s'", (char *)gwp_conf->app_key
+	);
+	pthread_mutex_lock(&mutex);
+	res = PQexec(conn, db_query);
+	pthread_mutex_unlock(&mutex);
+
+	if ((PQresultStatus(res) == PGRES_TUPLES_OK) && PQntuples(res)) {
+		base64_decode(PQgetvalue(res, 0, 0), strlen(PQgetvalue(res, 0, 0))-1, gwp_conf->secure_key);
+		gwp_conf->secure = PQgetvalue(res, 0, 1)[0] == 't';
+	} else {
+		perror("gateway_protocol_checkup_callback error");
 		gw_stat.errors_count++;
 	}
-	PQclear(res);
+	PQclear(res);
+}
+
+int send_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint16_t pck_size) {
+	struct iovec iov;
+
+	iov.iov_base 	= pck;
+	iov.iov_len 	= pck_size;
+
+	return send_gcom_ch_iov(gch, &iov, 1);
+}
+
+/* Sends the frames of iov with one system call, and most often one
+ * segment, unless the send buffer is short. Client sockets are
+ * non-blocking, a full send buffer is waited for. iov is consumed. A
+ * datagram carries one frame, each is sent on its own on UDP.
+ */
+int send_gcom_ch_iov(gcom_ch_t *gch, struct iovec *iov, int iovcnt) {
+	struct pollfd pfd;
+	struct msghdr msg;
+	ssize_t ret;
+	int sent = 0;
+
+	if (gch->udp) {
+		for (int i = 0; i < iovcnt; i++) {
+			if ((ret = gcom_udp_send(gch->udp, &gch->client, (uint8_t *)iov[i].iov_base, iov[i].iov_len)) < 0) {
+				return -1;
+			}
+			sent += ret;
+		}
+		return sent;
+	}
+
+	pfd.fd 		= gch->client_desc;
+	pfd.events 	= POLLOUT;
+
+	memset(&msg, 0x0, sizeof(msg));
+	msg.msg_iov 	= iov;
+	msg.msg_iovlen 	= iovcnt;
+
+	if (gch->session) {
+		pthread_mutex_lock(&gch->session->send_mutex);
+	}
+	while (msg.msg_iovlen) {
+		if ((ret = sendmsg(gch->client_desc, &msg, MSG_NOSIGNAL)) >= 0) {
+			sent += ret;
+			/* what a partial write left */
+			for (; msg.msg_iovlen && (size_t)ret >= msg.msg_iov->iov_len; msg.msg_iov++, msg.msg_iovlen--) {
+				ret -= msg.msg_iov->iov_len;
+			}
+			if (msg.msg_iovlen) {
+				msg.msg_iov->iov_base 	= (uint8_t *)msg.msg_iov->iov_base + ret;
+				msg.msg_iov->iov_len 	-= ret;
+			}
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if ((errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, SEND_WAIT_MS) > 0) {
+			continue;
+		}
+		gw_stat.errors_count++;
+		perror("sendto error");
+		sent = -1;
+		break;
+	}
+	if (gch->session) {
+		pthread_mutex_unlock(&gch->session->send_mutex);
+	}
+
+	return sent;
+}
+
+/* Reads what arrived on the connection. A packet is complete with its
+ * frame, as told by its header, or once a client of an application the
+ * receiver has no key for shuts down its side. Returns 1 then, 0 while
+ * more is to come and -1 once nothing more is. On a ring, the loop has
+ * received what arrived already.
+ */
+int recv_gcom_ch(gcom_client_t *client) {
+	gcom_ch_request_t *req = client->req;
+	ssize_t ret;
+
+	while (1) {
+		if (!client->frame_length && client->recv_length) {
+			client->frame_length = gcom_frame_length(req->packet, client->recv_length);
+		}
+		if (client->frame_length > gw_static_conf->frame_size_max ||
+		    (client->frame_length < 0 && client->recv_length == gw_static_conf->frame_size_max)) {
+			fprintf(stderr, "packet too long\n");
+			gw_stat.errors_count++;
+			return -1;
+		}
+		if (client->frame_length > 0 && client->recv_length >= client->frame_length) {
+			req->packet_length = client->frame_length;
+			return 1;
+		}
+		if (client->shut) {
+			break;
+		}
+		if (client->loop->ring) {
+			return 0; // the ring receives
+		}
+
+		ret = recv(client->desc, req->packet + client->recv_length,
+			   gw_static_conf->frame_size_max - client->recv_length, 0);
+		if (ret > 0) {
+			client->recv_length += ret;
+			continue;
+		}
+		if (!ret) {
+			client->shut = 1;
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		perror("socket receive error");
+		gw_stat.errors_count++;
+		return -1;
+	}
+
+	/* shut down, possibly before the end of its frame */
+	if (!client->recv_length || client->frame_length > 0) {
+		return -1;
+	}
+	req->packet_length = client->recv_length;
+
+	return 1;
+}
+
+/* Length of the frame starting at pck: app_key, then dev_id, type and
+ * payload length ahead of the payload, encrypted by AES blocks for secure
+ * applications. Returns 0 while the header is not all in and -1 if the
+ * application is not known.
+ */
+int gcom_frame_length(const uint8_t *pck, uint16_t pck_length) {
+	uint8_t block[AES_BLOCKLEN];
+	gcom_app_key_t *ak;
+	int length = -1;
+
+	if (pck_length < GATEWAY_PROTOCOL_APPKEY_SIZE + 3) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&app_keys_mutex);
+	for (ak = app_keys[gcom_app_key_hash(pck)]; ak; ak = ak->next) {
+		if (!memcmp(ak->app_key, pck, GATEWAY_PROTOCOL_APPKEY_SIZE)) {
+			break;
+		}
+	}
+	if (ak && !ak->secure) {
+		length = gateway_protocol_packet_length(pck + GATEWAY_PROTOCOL_APPKEY_SIZE,
+							pck_length - GATEWAY_PROTOCOL_APPKEY_SIZE, 0);
+	} else if (ak && pck_length < GATEWAY_PROTOCOL_APPKEY_SIZE + AES_BLOCKLEN) {
+		length = 0;
+	} else if (ak) {
+		/* ECB, the first block alone holds the header */
+		memcpy(block, pck + GATEWAY_PROTOCOL_APPKEY_SIZE, AES_BLOCKLEN);
+		AES_ECB_decrypt(&ak->aes_ctx, block);
+		length = gateway_protocol_packet_length(block, AES_BLOCKLEN, 1);
+	}
+	pthread_mutex_unlock(&app_keys_mutex);
+
+	/* a malformed length is longer than any frame */
+	return ak && length < 0 ? INT32_MAX : length;
+}
+
+/* A listening socket on port. With reuseport several of them share the
+ * port, the kernel spreads the connections among them.
+ */
+int gcom_ch_listen(gcom_ch_t *gch, uint16_t port, uint8_t reuseport) {
+	int on = 1;
+
+	memset(gch, 0x0, sizeof(gcom_ch_t));
+
+	if ((gch->server_desc = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		perror("socket creation error");
+		return -1;
+	}
+
+	gch->session 			= NULL;
+	gch->server.sin_family 		= AF_INET;
+	gch->server.sin_port		= htons(port);
+	gch->server.sin_addr.s_addr 	= htonl(INADDR_ANY);
+
+	if (reuseport && setsockopt(gch->server_desc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		perror("SO_REUSEPORT error");
+		close(gch->server_desc);
+		return -1;
+	}
+
+	if (bind(gch->server_desc, (struct sockaddr *) &gch->server, sizeof(gch->server)) < 0) {
+		perror("binding error");
+		close(gch->server_desc);
+		return -1;
+	}
+
+	/* connections are accepted as they come, not as workers free up */
+	if (listen(gch->server_desc, SOMAXCONN) < 0) {
+		perror("listen error");
+		close(gch->server_desc);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Picks the listener of a connection by a hash of its IPv4 source address
+ * instead of the 4-tuple, so a device keeps landing on the same listener
+ * thread. The program returns the index of the socket in the reuseport
+ * group, that is in the order they were bound.
+ */
+int gcom_listeners_steer(int server_desc, int listeners_num) {
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 12) },	// A = ip->saddr
+		{ BPF_ALU | BPF_MUL | BPF_K,   0, 0, 2654435761u },			// A *= golden ratio
+		{ BPF_ALU | BPF_RSH | BPF_K,   0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32_t)listeners_num },
+		{ BPF_RET | BPF_A,             0, 0, 0 },
+	};
+	struct sock_fprog prog;
+
+	prog.len 	= sizeof(code) / sizeof(code[0]);
+	prog.filter 	= code;
+
+	return setsockopt(server_desc, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int gcom_loop_init(gcom_loop_t *loop, gcom_ch_t *gch) {
+	struct epoll_event ev;
+
+	loop->gch 		= gch;
+	loop->ring 		= NULL;
+	loop->epoll_desc 	= -1;
+	loop->first 		= NULL;
+	loop->last  		= NULL;
+	loop->released 		= NULL;
+	loop->resume 		= NULL;
+	loop->ring_recvs 	= 0;
+	loop->keep_alive 	= gw_static_conf->keep_alive_idle_ms > 0;
+	loop->inflight_max 	= gw_static_conf->keep_alive_inflight_max ? gw_static_conf->keep_alive_inflight_max : 1;
+	loop->timeout_ns 	= (uint64_t)(loop->keep_alive ? gw_static_conf->keep_alive_idle_ms :
+							gw_static_conf->recv_timeout_ms) * 1000000;
+	pthread_mutex_init(&loop->resume_mutex, NULL);
+
+	if (fcntl(gch->server_desc, F_SETFL, fcntl(gch->server_desc, F_GETFL) | O_NONBLOCK) < 0) {
+		return -1;
+	}
+
+	if ((loop->event_desc = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	if (!(loop->client_pool = obj_pool_create(sizeof(gcom_client_t), 0))) {
+		close(loop->event_desc);
+		return -1;
+	}
+
+	if (gw_static_conf->io_uring && !gcom_loop_init_ring(loop)) {
+		return 0;
+	}
+
+	if ((loop->epoll_desc = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		obj_pool_destroy(loop->client_pool);
+		close(loop->event_desc);
+		return -1;
+	}
+
+	/* the listener is the only entry without a client, the eventfd the
+	 * one of the loop itself */
+	ev.events 	= EPOLLIN | EPOLLET;
+	ev.data.ptr 	= NULL;
+	if (epoll_ctl(loop->epoll_desc, EPOLL_CTL_ADD, gch->server_desc, &ev) < 0) {
+		obj_pool_destroy(loop->client_pool);
+		close(loop->event_desc);
+		close(loop->epoll_desc);
+		return -1;
+	}
+	ev.data.ptr 	= loop;
+	if (epoll_ctl(loop->epoll_desc, EPOLL_CTL_ADD, loop->event_desc, &ev) < 0) {
+		obj_pool_destroy(loop->client_pool);
+		close(loop->event_desc);
+		close(loop->epoll_desc);
+		return -1;
+	}
+
+	return 0;
 }
 
-int send_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint8_t pck_size) {
-	int ret;
-	
-	if ((ret = send(gch->client_desc, pck, pck_size, 0)) < 0) {
-		gw_stat.errors_count++;
-		perror("sendto error");
+/* The listener is accepted from and the eventfd read by operations that
+ * stay in the ring. Kernels without io_uring, or with one too old for
+ * the loop, leave it to epoll.
+ */
+int gcom_loop_init_ring(gcom_loop_t *loop) {
+	if (!(loop->ring = io_ring_create(GATEWAY_RING_ENTRIES))) {
+		perror("io_uring setup error, epoll");
+		return -1;
 	}
 
-	return ret;
+	loop->accept_multishot = 1;
+	if (io_ring_accept(loop->ring, loop->gch->server_desc, loop->accept_multishot, 0) ||
+	    io_ring_read(loop->ring, loop->event_desc, &loop->event_value, sizeof(eventfd_t), (uintptr_t)loop)) {
+		perror("io_uring setup error, epoll");
+		io_ring_destroy(loop->ring);
+		loop->ring = NULL;
+		return -1;
+	}
+
+	return 0;
 }
 
-int recv_gcom_ch(gcom_ch_t *gch, uint8_t *pck, uint8_t *pck_length, uint16_t pck_size) {
-	int ret = -1;
-	
-	if ((gch->client_desc = accept(gch->server_desc, (struct sockaddr *)&gch->client, &gch->sock_len)) < 0) {
+/* Connections still answered by workers outlive the loop, so do their
+ * pool and the eventfd they wake it with. The receives left in the ring
+ * are cancelled and waited for, their buffers go back to the pool.
+ */
+void gcom_loop_destroy(gcom_loop_t *loop) {
+	io_ring_event_t events[GATEWAY_EPOLL_EVENTS];
+	int events_num;
+
+	while (loop->first) {
+		gcom_client_release(loop, loop->first);
+	}
+	gcom_loop_flush(loop);
+
+	if (!loop->ring) {
+		close(loop->epoll_desc);
+		return;
+	}
+
+	while (loop->ring_recvs > 0 &&
+	       (events_num = io_ring_wait(loop->ring, events, GATEWAY_EPOLL_EVENTS, SEND_WAIT_MS)) > 0) {
+		for (int i = 0; i < events_num; i++) {
+			if (!events[i].data && events[i].res >= 0) {
+				close(events[i].res);
+			} else if (events[i].data && events[i].data != (uintptr_t)loop) {
+				gcom_loop_complete(loop, &events[i]);
+			}
+		}
+		gcom_loop_flush(loop);
+	}
+	io_ring_destroy(loop->ring);
+}
+
+/* only complete packets reach the workers */
+void gcom_loop_run(gcom_loop_t *loop) {
+	struct epoll_event events[GATEWAY_EPOLL_EVENTS];
+	int events_num;
+	void *ptr;
+
+	if (loop->ring) {
+		gcom_loop_run_ring(loop);
+		return;
+	}
+
+	while (__atomic_load_n(&working, __ATOMIC_RELAXED)) {
+		events_num = epoll_wait(loop->epoll_desc, events, GATEWAY_EPOLL_EVENTS, gcom_loop_expire(loop));
+		if (events_num < 0) {
+			if (errno != EINTR) {
+				perror("epoll_wait error");
+				gw_stat.errors_count++;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < events_num; i++) {
+			if (!(ptr = events[i].data.ptr)) {
+				gcom_ch_accept(loop);
+			} else if (ptr == loop) {
+				eventfd_read(loop->event_desc, &loop->event_value);
+				gcom_loop_resume(loop);
+			} else {
+				gcom_client_process(loop, (gcom_client_t *)ptr);
+			}
+		}
+
+		gcom_loop_flush(loop);
+	}
+}
+
+/* what a round asks of the ring goes in with the wait of the next one */
+void gcom_loop_run_ring(gcom_loop_t *loop) {
+	io_ring_event_t events[GATEWAY_EPOLL_EVENTS];
+	int events_num;
+
+	while (__atomic_load_n(&working, __ATOMIC_RELAXED)) {
+		events_num = io_ring_wait(loop->ring, events, GATEWAY_EPOLL_EVENTS, gcom_loop_expire(loop));
+		if (events_num < 0) {
+			if (errno != EINTR) {
+				perror("io_uring wait error");
+				gw_stat.errors_count++;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < events_num; i++) {
+			gcom_loop_complete(loop, &events[i]);
+		}
+
+		gcom_loop_flush(loop);
+	}
+}
+
+/* a completion of the listener (0), the eventfd (loop) or a client */
+void gcom_loop_complete(gcom_loop_t *loop, const io_ring_event_t *ev) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	gcom_client_t *client;
+
+	if (!ev->data) {
+		if (ev->res >= 0) {
+			/* multishot accepts do not take an address */
+			if (getpeername(ev->res, (struct sockaddr *)&addr, &addr_len) < 0) {
+				memset(&addr, 0x0, sizeof(addr));
+			}
+			if ((client = gcom_client_open(loop, ev->res, &addr, addr_len))) {
+				gcom_client_process(loop, client);
+			}
+		} else if (ev->res == -EINVAL && loop->accept_multishot) {
+			loop->accept_multishot = 0; // before multishot accepts
+		} else if (ev->res != -EINTR && ev->res != -ECONNABORTED && ev->res != -EAGAIN) {
+			errno = -ev->res;
+			perror("socket accept error");
+			gw_stat.errors_count++;
+		}
+		if (!ev->more && io_ring_accept(loop->ring, loop->gch->server_desc, loop->accept_multishot, 0)) {
+			perror("io_uring accept error");
+			gw_stat.errors_count++;
+		}
+		return;
+	}
+
+	if (ev->data == (uintptr_t)loop) {
+		io_ring_read(loop->ring, loop->event_desc, &loop->event_value, sizeof(eventfd_t), (uintptr_t)loop);
+		gcom_loop_resume(loop);
+		return;
+	}
+
+	client = (gcom_client_t *)(uintptr_t)ev->data;
+	loop->ring_recvs--;
+
+	/* released while receiving, the buffer stayed with the ring */
+	if (!client->req) {
+		obj_pool_free(req_pool, client->ring_req);
+		client->ring_req = NULL;
+		gcom_client_put(client);
+		return;
+	}
+	client->ring_req = NULL;
+
+	if (ev->res > 0) {
+		client->recv_length += ev->res;
+	} else if (!ev->res) {
+		client->shut = 1;
+	} else if (ev->res != -EINTR && ev->res != -EAGAIN) {
+		errno = -ev->res;
 		perror("socket receive error");
 		gw_stat.errors_count++;
+		gcom_client_release(loop, client);
+		gcom_client_put(client);
+		return;
+	}
+
+	gcom_client_process(loop, client);
+	gcom_client_put(client);
+}
+
+void * gcom_loop_thread(void *loop) {
+	gcom_loop_run((gcom_loop_t *)loop);
+
+	return NULL;
+}
+
+/* the loop goes round and sees working cleared */
+void gcom_loop_wakeup(gcom_loop_t *loop) {
+	eventfd_write(loop->event_desc, 1);
+}
+
+/* drops the connections idle for too long, returns the epoll_wait
+ * timeout until the next one is */
+int gcom_loop_expire(gcom_loop_t *loop) {
+	uint64_t now_ns = task_queue_now_ns();
+	gcom_client_t *client;
+
+	while ((client = loop->first) && client->expire_ns <= now_ns) {
+		/* not idle while the device waits for an answer */
+		if (__atomic_load_n(&client->inflight, __ATOMIC_SEQ_CST)) {
+			gcom_client_touch(loop, client);
+			continue;
+		}
+		if (!loop->keep_alive || client->recv_length) {
+			fprintf(stderr, "packet receive timeout\n");
+			gw_stat.errors_count++;
+		}
+		gcom_client_release(loop, client);
+	}
+	gcom_loop_flush(loop);
+
+	if (!loop->first) {
+		return -1;
+	}
+
+	return (int)((loop->first->expire_ns - now_ns + 999999) / 1000000);
+}
+
+/* connections whose in-flight frames went below the cap */
+void gcom_loop_resume(gcom_loop_t *loop) {
+	gcom_client_t *client, *next;
+
+	pthread_mutex_lock(&loop->resume_mutex);
+	client = loop->resume;
+	loop->resume = NULL;
+	pthread_mutex_unlock(&loop->resume_mutex);
+
+	for (; client; client = next) {
+		next = client->resume_next;
+		gcom_client_process(loop, client);
+		gcom_client_put(client);
+	}
+}
+
+/* the loop references of the connections released by this round, an
+ * event later in the round may still point to them */
+void gcom_loop_flush(gcom_loop_t *loop) {
+	gcom_client_t *client;
+
+	while ((client = loop->released)) {
+		loop->released = client->next;
+		gcom_client_put(client);
+	}
+}
+
+/* edge triggered, accepts until the backlog is empty */
+int gcom_ch_accept(gcom_loop_t *loop) {
+	struct epoll_event ev;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	gcom_client_t *client;
+	int desc, accepted = 0;
+
+	while (1) {
+		addr_len = sizeof(addr);
+		if ((desc = accept4(loop->gch->server_desc, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("socket accept error");
+				gw_stat.errors_count++;
+			}
+			return accepted;
+		}
+
+		if (!(client = gcom_client_open(loop, desc, &addr, addr_len))) {
+			continue;
+		}
+
+		ev.events 	= EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr 	= client;
+		if (epoll_ctl(loop->epoll_desc, EPOLL_CTL_ADD, desc, &ev) < 0) {
+			perror("epoll_ctl error");
+			gw_stat.errors_count++;
+			gcom_client_release(loop, client);
+			continue;
+		}
+
+		accepted++;
+	}
+}
+
+/* the connection of an accepted socket, closed on error */
+gcom_client_t * gcom_client_open(gcom_loop_t *loop, int desc, const struct sockaddr_in *addr, socklen_t addr_len) {
+	gcom_client_t *client;
+	gcom_ch_request_t *req;
+
+	req 	= (gcom_ch_request_t *)obj_pool_alloc(req_pool);
+	client 	= (gcom_client_t *)obj_pool_alloc(loop->client_pool);
+	if (!req || !client) {
+		fprintf(stderr, "request allocation error\n");
+		if (req) {
+			obj_pool_free(req_pool, req);
+		}
+		if (client) {
+			obj_pool_free(loop->client_pool, client);
+		}
+		close(desc);
+		return NULL;
+	}
+
+	// packet and payload are always written before being read
+	memset(req, 0x0, offsetof(gcom_ch_request_t, packet));
+	memcpy(&req->gch, loop->gch, sizeof(gcom_ch_t));
+	req->gch.client_desc 	= desc;
+	req->gch.client 	= *addr;
+	req->gch.sock_len 	= addr_len;
+	req->gch.session 	= client;
+
+	client->desc 		= desc;
+	client->refs 		= 1;
+	client->inflight 	= 0;
+	client->paused 		= 0;
+	client->shut 		= 0;
+	client->loop 		= loop;
+	client->req 		= req;
+	client->ring_req 	= NULL;
+	client->recv_length 	= 0;
+	client->frame_length 	= 0;
+	pthread_mutex_init(&client->send_mutex, NULL);
+
+	client->prev = client->next = NULL;
+	gcom_client_touch(loop, client);
+
+	return client;
+}
+
+/* Hands the frames of a connection to the workers, up to the in-flight
+ * cap in keep-alive mode and the first one otherwise. A paused connection
+ * is read again once a worker has answered one of its frames.
+ */
+void gcom_client_process(gcom_loop_t *loop, gcom_client_t *client) {
+	gcom_ch_request_t *req;
+
+	while (client->req) {
+		if (__atomic_load_n(&client->inflight, __ATOMIC_SEQ_CST) >= loop->inflight_max) {
+			__atomic_store_n(&client->paused, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&client->inflight, __ATOMIC_SEQ_CST) >= loop->inflight_max ||
+			    !__atomic_exchange_n(&client->paused, 0, __ATOMIC_SEQ_CST)) {
+				return; // resumed by a worker
+			}
+		}
+
+		switch (recv_gcom_ch(client)) {
+		case 0:
+			if (loop->ring) {
+				gcom_client_recv(loop, client);
+			}
+			return;
+		case -1:
+			gcom_client_release(loop, client);
+			return;
+		}
+
+		req = client->req;
+		__atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&client->inflight, 1, __ATOMIC_SEQ_CST);
+
+		/* the next frame is received while this one is processed */
+		if (!loop->keep_alive || !(client->req = gcom_client_next(client, req))) {
+			client->req = NULL;
+			gcom_client_release(loop, client);
+		} else {
+			gcom_client_touch(loop, client);
+		}
+
+		gcom_ch_request_submit(req);
+	}
+}
+
+/* Receives on a ring into the rest of the request buffer, the ring
+ * holds a reference until it completes. One receive at a time, so that
+ * a connection at its in-flight cap is not read from.
+ */
+void gcom_client_recv(gcom_loop_t *loop, gcom_client_t *client) {
+	if (client->ring_req) {
+		return;
+	}
+
+	if (io_ring_recv(loop->ring, client->desc, client->req->packet + client->recv_length,
+			 gw_static_conf->frame_size_max - client->recv_length, (uintptr_t)client)) {
+		perror("io_uring receive error");
+		gw_stat.errors_count++;
+		gcom_client_release(loop, client);
+		return;
+	}
+
+	__atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+	client->ring_req = client->req;
+	loop->ring_recvs++;
+}
+
+/* the request the next frame is received into, the bytes past the frame
+ * of req move over, before req goes to the workers */
+gcom_ch_request_t * gcom_client_next(gcom_client_t *client, gcom_ch_request_t *req) {
+	gcom_ch_request_t *next;
+
+	if (!(next = (gcom_ch_request_t *)obj_pool_alloc(req_pool))) {
+		fprintf(stderr, "request allocation error\n");
+		return NULL;
+	}
+
+	memset(next, 0x0, offsetof(gcom_ch_request_t, packet));
+	memcpy(&next->gch, &req->gch, sizeof(gcom_ch_t));
+
+	client->recv_length 	-= req->packet_length;
+	client->frame_length 	= 0;
+	memcpy(next->packet, req->packet + req->packet_length, client->recv_length);
+
+	return next;
+}
+
+/* the connection is active, it moves to the end of the expiry list */
+void gcom_client_touch(gcom_loop_t *loop, gcom_client_t *client) {
+	if (client->prev || loop->first == client) {
+		if (client->prev) {
+			client->prev->next = client->next;
+		} else {
+			loop->first = client->next;
+		}
+		if (client->next) {
+			client->next->prev = client->prev;
+		} else {
+			loop->last = client->prev;
+		}
+	}
+
+	/* same timeout for all, the list stays sorted by expiry */
+	client->expire_ns = task_queue_now_ns() + loop->timeout_ns;
+	client->next = NULL;
+	if ((client->prev = loop->last)) {
+		loop->last->next = client;
+	} else {
+		loop->first = client;
+	}
+	loop->last = client;
+}
+
+/* The connection is not read anymore, its socket is closed once the
+ * requests in flight are answered.
+ */
+void gcom_client_release(gcom_loop_t *loop, gcom_client_t *client) {
+	if (!loop->ring) {
+		epoll_ctl(loop->epoll_desc, EPOLL_CTL_DEL, client->desc, NULL);
+	} else if (client->ring_req) {
+		io_ring_cancel(loop->ring, (uintptr_t)client);
+	}
+
+	if (client->prev) {
+		client->prev->next = client->next;
+	} else {
+		loop->first = client->next;
+	}
+	if (client->next) {
+		client->next->prev = client->prev;
 	} else {
-		*pck_length = recv(gch->client_desc, pck, pck_size, MSG_WAITALL);
+		loop->last = client->prev;
+	}
+
+	if (client->req && client->req != client->ring_req) {
+		obj_pool_free(req_pool, client->req);
+	}
+	client->req = NULL;
+
+	client->prev = NULL;
+	client->next = loop->released;
+	loop->released = client;
+}
+
+void gcom_client_put(gcom_client_t *client) {
+	if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	close(client->desc);
+	pthread_mutex_destroy(&client->send_mutex);
+	obj_pool_free(client->loop->client_pool, client);
+}
+
+/* A request is done with, answered or not. A connection paused at its
+ * in-flight cap goes back to the loop.
+ */
+void gcom_ch_request_free(gcom_ch_request_t *req) {
+	gcom_client_t *client = req->gch.session;
+	gcom_loop_t *loop;
+
+	obj_pool_free(req_pool, req);
+
+	if (!client) {
+		return;
+	}
+	loop = client->loop;
+
+	if (__atomic_sub_fetch(&client->inflight, 1, __ATOMIC_SEQ_CST) < loop->inflight_max &&
+	    __atomic_exchange_n(&client->paused, 0, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);	// of the resume list
+		pthread_mutex_lock(&loop->resume_mutex);
+		client->resume_next = loop->resume;
+		loop->resume = client;
+		pthread_mutex_unlock(&loop->resume_mutex);
+		eventfd_write(loop->event_desc, 1);
+	}
+
+	gcom_client_put(client);
+}
+
+/* the device is told the request is over, datagrams have nothing to end */
+void gcom_ch_shutdown(gcom_ch_t *gch) {
+	if (!gch->udp) {
+		shutdown(gch->client_desc, SHUT_RDWR);
+	}
+}
+
+int gcom_udp_open(gcom_udp_t *udp, uint16_t port) {
+	memset(&udp->gch, 0x0, sizeof(gcom_ch_t));
+
+	if ((udp->gch.server_desc = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) < 0) {
+		perror("socket creation error");
+		return -1;
+	}
+
+	udp->gch.client_desc 		= udp->gch.server_desc;
+	udp->gch.udp 			= udp;
+	udp->gch.server.sin_family 	= AF_INET;
+	udp->gch.server.sin_port	= htons(port);
+	udp->gch.server.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(udp->gch.server_desc, (struct sockaddr *) &udp->gch.server, sizeof(udp->gch.server)) < 0) {
+		perror("binding error");
+		close(udp->gch.server_desc);
+		return -1;
+	}
+
+	pthread_mutex_init(&udp->send_mutex, NULL);
+	pthread_cond_init(&udp->send_cond, NULL);
+	udp->queuing 	= 0;
+	udp->flushing 	= 0;
+	udp->batches[0].length = udp->batches[1].length = 0;
+
+	return 0;
+}
+
+/* Wakes the receiver: a shutdown of an unconnected UDP socket fails with
+ * ENOTCONN but still ends the recvmmsg it blocks in. The socket stays
+ * open for the replies of the requests in flight.
+ */
+void gcom_udp_stop(gcom_udp_t *udp) {
+	shutdown(udp->gch.server_desc, SHUT_RD);
+	pthread_join(udp->thread, NULL);
+}
+
+/* a batch of datagrams per system call, each into its own request */
+void * gcom_udp_thread(void *arg) {
+	gcom_udp_t *udp = (gcom_udp_t *)arg;
+	gcom_ch_request_t *reqs[GATEWAY_UDP_BATCH] = {NULL};
+	struct mmsghdr msgs[GATEWAY_UDP_BATCH];
+	struct iovec iovs[GATEWAY_UDP_BATCH];
+	int msgs_num, i;
+
+	while (__atomic_load_n(&working, __ATOMIC_RELAXED)) {
+		for (i = 0; i < GATEWAY_UDP_BATCH; i++) {
+			if (!reqs[i]) {
+				if (!(reqs[i] = (gcom_ch_request_t *)obj_pool_alloc(req_pool))) {
+					break;
+				}
+				// packet and payload are always written before being read
+				memset(reqs[i], 0x0, offsetof(gcom_ch_request_t, packet));
+				memcpy(&reqs[i]->gch, &udp->gch, sizeof(gcom_ch_t));
+			}
+			iovs[i].iov_base 		= reqs[i]->packet;
+			iovs[i].iov_len 		= gw_static_conf->frame_size_max;
+			memset(&msgs[i].msg_hdr, 0x0, sizeof(struct msghdr));
+			msgs[i].msg_hdr.msg_name 	= &reqs[i]->gch.client;
+			msgs[i].msg_hdr.msg_namelen 	= sizeof(struct sockaddr_in);
+			msgs[i].msg_hdr.msg_iov 	= &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen 	= 1;
+		}
+		if (!i) {
+			fprintf(stderr, "request allocation error\n");
+			usleep(SEND_WAIT_MS * 1000);
+			continue;
+		}
+
+		/* blocks for the first one only */
+		if ((msgs_num = recvmmsg(udp->gch.server_desc, msgs, i, MSG_WAITFORONE, NULL)) < 0) {
+			if (errno != EINTR) {
+				perror("socket receive error");
+				gw_stat.errors_count++;
+			}
+			continue;
+		}
+
+		for (i = 0; i < msgs_num; i++) {
+			/* the frame is the datagram */
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "packet too long\n");
+				gw_stat.errors_count++;
+				continue;
+			}
+			if (!msgs[i].msg_len) {
+				continue;
+			}
+			reqs[i]->packet_length 	= msgs[i].msg_len;
+			reqs[i]->gch.sock_len 	= msgs[i].msg_hdr.msg_namelen;
+			gcom_ch_request_submit(reqs[i]);
+			reqs[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < GATEWAY_UDP_BATCH; i++) {
+		if (reqs[i]) {
+			obj_pool_free(req_pool, reqs[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* queues the reply, and sends the queued ones if no other worker does */
+int gcom_udp_send(gcom_udp_t *udp, const struct sockaddr_in *addr, const uint8_t *pck, uint16_t pck_size) {
+	gcom_udp_batch_t *batch;
+	int ret, sent;
+
+	if (pck_size > DEVICE_DATA_MAX_LENGTH) {
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	return ret;
+	pthread_mutex_lock(&udp->send_mutex);
+	while ((batch = &udp->batches[udp->queuing])->length == GATEWAY_UDP_BATCH) {
+		pthread_cond_wait(&udp->send_cond, &udp->send_mutex);
+	}
+	memcpy(batch->pcks[batch->length], pck, pck_size);
+	batch->addrs[batch->length] 	= *addr;
+	batch->iovs[batch->length].iov_len = pck_size;
+	batch->length++;
+
+	if (udp->flushing) {
+		pthread_mutex_unlock(&udp->send_mutex);
+		return pck_size;
+	}
+	udp->flushing = 1;
+
+	while ((batch = &udp->batches[udp->queuing])->length) {
+		udp->queuing ^= 1;
+		pthread_cond_broadcast(&udp->send_cond);
+		pthread_mutex_unlock(&udp->send_mutex);
+
+		for (int i = 0; i < batch->length; i++) {
+			batch->iovs[i].iov_base 		= batch->pcks[i];
+			memset(&batch->msgs[i].msg_hdr, 0x0, sizeof(struct msghdr));
+			batch->msgs[i].msg_hdr.msg_name 	= &batch->addrs[i];
+			batch->msgs[i].msg_hdr.msg_namelen 	= sizeof(struct sockaddr_in);
+			batch->msgs[i].msg_hdr.msg_iov 		= &batch->iovs[i];
+			batch->msgs[i].msg_hdr.msg_iovlen 	= 1;
+		}
+		for (sent = 0; sent < batch->length; sent += ret) {
+			if ((ret = sendmmsg(udp->gch.server_desc, batch->msgs + sent, batch->length - sent, 0)) > 0) {
+				continue;
+			}
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			/* the datagram the error is about is skipped */
+			perror("sendto error");
+			gw_stat.errors_count++;
+			ret = 1;
+		}
+
+		pthread_mutex_lock(&udp->send_mutex);
+		batch->length = 0;
+	}
+
+	udp->flushing = 0;
+	pthread_cond_broadcast(&udp->send_cond);
+	pthread_mutex_unlock(&udp->send_mutex);
+
+	return pck_size;
 }
 
 
@@ -655,6 +2664,130 @@ static void process_static_conf(json_value* value, static_conf_t *st_conf) {
 	strncpy(st_conf->platform_gw_manager_ip, value->u.object.values[4].value->u.string.ptr, sizeof(st_conf->platform_gw_manager_ip));
 	st_conf->platform_gw_manager_port = value->u.object.values[5].value->u.integer;
 	st_conf->thread_pool_size = value->u.object.values[6].value->u.integer;
+
+	/* optional entries */
+	json_value *opt;
+
+	strncpy(st_conf->task_queue_backend, "list", sizeof(st_conf->task_queue_backend));
+	if ((opt = json_conf_get(value, "task_queue_backend")) && opt->type == json_string) {
+		strncpy(st_conf->task_queue_backend, opt->u.string.ptr, sizeof(st_conf->task_queue_backend)-1);
+	}
+	st_conf->task_queue_capacity = 1024;
+	if ((opt = json_conf_get(value, "task_queue_capacity")) && opt->type == json_integer) {
+		st_conf->task_queue_capacity = opt->u.integer;
+	}
+	st_conf->task_queue_dispatch_hash = 0;
+	if ((opt = json_conf_get(value, "task_queue_dispatch")) && opt->type == json_string) {
+		st_conf->task_queue_dispatch_hash = !strcmp(opt->u.string.ptr, "hash");
+	}
+	st_conf->task_queue_sched_weighted = 0;
+	if ((opt = json_conf_get(value, "task_queue_sched")) && opt->type == json_string) {
+		st_conf->task_queue_sched_weighted = !strcmp(opt->u.string.ptr, "weighted");
+	}
+	st_conf->task_queue_max_size = 0;
+	if ((opt = json_conf_get(value, "task_queue_max_size")) && opt->type == json_integer) {
+		st_conf->task_queue_max_size = opt->u.integer;
+	}
+	strncpy(st_conf->task_queue_overflow, "reject", sizeof(st_conf->task_queue_overflow));
+	if ((opt = json_conf_get(value, "task_queue_overflow")) && opt->type == json_string) {
+		strncpy(st_conf->task_queue_overflow, opt->u.string.ptr, sizeof(st_conf->task_queue_overflow)-1);
+	}
+	/* below thread_pool_size the request pool adapts its concurrency */
+	st_conf->thread_pool_min_size = st_conf->thread_pool_size;
+	if ((opt = json_conf_get(value, "thread_pool_min_size")) && opt->type == json_integer) {
+		st_conf->thread_pool_min_size = opt->u.integer;
+	}
+	st_conf->recv_timeout_ms = 5000;
+	if ((opt = json_conf_get(value, "recv_timeout_ms")) && opt->type == json_integer) {
+		st_conf->recv_timeout_ms = opt->u.integer;
+	}
+	/* devices sending several packets per connection */
+	st_conf->keep_alive_idle_ms = 0;
+	if ((opt = json_conf_get(value, "keep_alive_idle_ms")) && opt->type == json_integer) {
+		st_conf->keep_alive_idle_ms = opt->u.integer;
+	}
+	st_conf->keep_alive_inflight_max = 4;
+	if ((opt = json_conf_get(value, "keep_alive_inflight_max")) && opt->type == json_integer) {
+		st_conf->keep_alive_inflight_max = opt->u.integer;
+	}
+	st_conf->listener_threads = 1;
+	if ((opt = json_conf_get(value, "listener_threads")) && opt->type == json_integer) {
+		st_conf->listener_threads = opt->u.integer;
+	}
+	st_conf->listener_steer_hash = 0;
+	if ((opt = json_conf_get(value, "listener_steering")) && opt->type == json_string) {
+		st_conf->listener_steer_hash = !strcmp(opt->u.string.ptr, "source_hash");
+	}
+	st_conf->udp_port = 0;
+	if ((opt = json_conf_get(value, "udp_port")) && opt->type == json_integer) {
+		st_conf->udp_port = opt->u.integer;
+	}
+	/* devices reading every frame of an answer, not only the first one */
+	st_conf->downlink_coalesce = 0;
+	if ((opt = json_conf_get(value, "downlink_coalesce")) && opt->type == json_boolean) {
+		st_conf->downlink_coalesce = opt->u.boolean;
+	}
+	/* the answers are encoded into the packet buffer too */
+	st_conf->frame_size_max = DEVICE_DATA_MAX_LENGTH;
+	if ((opt = json_conf_get(value, "frame_size_max")) && opt->type == json_integer) {
+		if (opt->u.integer > GATEWAY_PROTOCOL_PACKET_SIZE_MAX) {
+			st_conf->frame_size_max = GATEWAY_PROTOCOL_PACKET_SIZE_MAX;
+		} else if (opt->u.integer > DEVICE_DATA_MAX_LENGTH) {
+			st_conf->frame_size_max = opt->u.integer;
+		}
+	}
+	st_conf->io_uring = 0;
+	if ((opt = json_conf_get(value, "io_backend")) && opt->type == json_string) {
+		st_conf->io_uring = !strcmp(opt->u.string.ptr, "io_uring");
+	}
+	st_conf->decode_pool_size = 2;
+	if ((opt = json_conf_get(value, "decode_pool_size")) && opt->type == json_integer) {
+		st_conf->decode_pool_size = opt->u.integer;
+	}
+	/* time a device waits for its answer, requests taken later are dropped */
+	st_conf->deadline_decode_ms 	= 5000;
+	st_conf->deadline_time_req_ms 	= 1000;
+	st_conf->deadline_data_send_ms 	= 5000;
+	st_conf->deadline_pend_req_ms 	= 3000;
+	st_conf->deadline_stat_ms 	= 5000;
+	if ((opt = json_conf_get(value, "request_deadline_ms")) && opt->type == json_object) {
+		json_value *dl;
+		if ((dl = json_conf_get(opt, "decode")) && dl->type == json_integer) {
+			st_conf->deadline_decode_ms = dl->u.integer;
+		}
+		if ((dl = json_conf_get(opt, "time_req")) && dl->type == json_integer) {
+			st_conf->deadline_time_req_ms = dl->u.integer;
+		}
+		if ((dl = json_conf_get(opt, "data_send")) && dl->type == json_integer) {
+			st_conf->deadline_data_send_ms = dl->u.integer;
+		}
+		if ((dl = json_conf_get(opt, "pend_req")) && dl->type == json_integer) {
+			st_conf->deadline_pend_req_ms = dl->u.integer;
+		}
+		if ((dl = json_conf_get(opt, "stat")) && dl->type == json_integer) {
+			st_conf->deadline_stat_ms = dl->u.integer;
+		}
+	}
+	/* consumer side batching of DATA_SEND inserts, 1 disables it */
+	st_conf->task_queue_batch_max = 1;
+	if ((opt = json_conf_get(value, "task_queue_batch_max")) && opt->type == json_integer) {
+		st_conf->task_queue_batch_max = opt->u.integer;
+	}
+	st_conf->task_queue_batch_wait_ms = 5;
+	if ((opt = json_conf_get(value, "task_queue_batch_wait_ms")) && opt->type == json_integer) {
+		st_conf->task_queue_batch_wait_ms = opt->u.integer;
+	}
+	/* high, normal, low */
+	st_conf->task_queue_weights[TASK_QUEUE_PRIO_HIGH] 	= 4;
+	st_conf->task_queue_weights[TASK_QUEUE_PRIO_NORMAL] 	= 2;
+	st_conf->task_queue_weights[TASK_QUEUE_PRIO_LOW] 	= 1;
+	if ((opt = json_conf_get(value, "task_queue_weights")) && opt->type == json_array) {
+		for (unsigned int i = 0; i < opt->u.array.length && i < TASK_QUEUE_PRIO_NUM; i++) {
+			if (opt->u.array.values[i]->type == json_integer) {
+				st_conf->task_queue_weights[i] = opt->u.array.values[i]->u.integer;
+			}
+		}
+	}
 }
 
 static void process_dynamic_conf(json_value* value, dynamic_conf_t *dyn_conf) {
@@ -666,6 +2799,18 @@ static void process_dynamic_conf(json_value* value, dynamic_conf_t *dyn_conf) {
 	dyn_conf->telemetry_send_period = value->u.object.values[5].value->u.integer;
 }
 
+static json_value * json_conf_get(json_value *value, const char *name) {
+	unsigned int i;
+
+	for (i = 0; i < value->u.object.length; i++) {
+		if (!strcmp(value->u.object.values[i].name, name)) {
+			return value->u.object.values[i].value;
+		}
+	}
+
+	return NULL;
+}
+
 static json_value * read_json_conf(const char *file_path) {
 	struct stat filestatus;
 	FILE *fp;
@@ -5,12 +5,15 @@
 
 static gateway_protocol_checkup_callback_t checkup_callback = NULL;
 
+static uint8_t gateway_protocol_varint_encode(uint16_t value, uint8_t *buf);
+static int gateway_protocol_varint_decode(uint16_t *value, const uint8_t *buf, uint16_t buf_length);
+
 void gateway_protocol_packet_encode (
     const gateway_protocol_conf_t *gwp_conf,
     const gateway_protocol_packet_type_t packet_type,
-    const uint8_t payload_length,
+    const uint16_t payload_length,
     const uint8_t *payload,
-    uint8_t *packet_length,
+    uint16_t *packet_length,
     uint8_t *packet)
 {
     *packet_length = 0;
@@ -21,35 +24,71 @@ void gateway_protocol_packet_encode (
     packet[*packet_length] = gwp_conf->dev_id;
     (*packet_length)++;
 
-    packet[*packet_length] = packet_type;
-    (*packet_length)++;
+    if (payload_length > GATEWAY_PROTOCOL_PAYLOAD_SIZE_LEGACY) {
+        packet[*packet_length] = packet_type | GATEWAY_PROTOCOL_PACKET_TYPE_VARINT;
+        (*packet_length)++;
 
-    packet[*packet_length] = payload_length;
-    (*packet_length)++;
+        (*packet_length) += gateway_protocol_varint_encode(payload_length, &packet[*packet_length]);
+    } else {
+        packet[*packet_length] = packet_type;
+        (*packet_length)++;
+
+        packet[*packet_length] = payload_length;
+        (*packet_length)++;
+    }
 
     memcpy(&packet[*packet_length], payload, payload_length);
     (*packet_length) += payload_length;
 
     if (gwp_conf->secure) {
+	    uint16_t length;
+
 	    security_adapter_encrypt(	gwp_conf->secure_key, 
 					&packet[GATEWAY_PROTOCOL_APP_KEY_SIZE], 
-					(uint16_t *)packet_length,
+					&length,
 					&packet[GATEWAY_PROTOCOL_APP_KEY_SIZE], 
 					(*packet_length-GATEWAY_PROTOCOL_APP_KEY_SIZE)
 	    );
-	    (*packet_length) += GATEWAY_PROTOCOL_APP_KEY_SIZE; 
+	    *packet_length = length + GATEWAY_PROTOCOL_APP_KEY_SIZE; 
     }
 }
 
-uint8_t gateway_protocol_packet_decode (
+uint16_t gateway_protocol_packet_decode (
     gateway_protocol_conf_t *gwp_conf,
     gateway_protocol_packet_type_t *packet_type,
-    uint8_t *payload_length,
+    uint16_t *payload_length,
     uint8_t *payload,
-    uint8_t packet_length,
+    uint16_t packet_length,
     uint8_t *packet)
 {
-    uint8_t p_len = 0;
+    gateway_protocol_packet_view_t view;
+    uint16_t p_len;
+
+    if (!(p_len = gateway_protocol_packet_view(gwp_conf, &view, packet_length, packet))) {
+        return 0;
+    }
+
+    if (packet_type) *packet_type = view.packet_type;
+
+    *payload_length = view.payload_length;
+    memcpy(payload, view.payload, view.payload_length);
+
+    return p_len;
+}
+
+uint16_t gateway_protocol_packet_view (
+    gateway_protocol_conf_t *gwp_conf,
+    gateway_protocol_packet_view_t *view,
+    uint16_t packet_length,
+    uint8_t *packet)
+{
+    uint16_t length = packet_length;
+    uint16_t p_len = 0;
+    int len_size;
+
+    if (packet_length < GATEWAY_PROTOCOL_APP_KEY_SIZE + 3) {
+        return 0;
+    }
 
     memcpy(gwp_conf->app_key, &packet[p_len], GATEWAY_PROTOCOL_APP_KEY_SIZE);
     p_len += GATEWAY_PROTOCOL_APP_KEY_SIZE;
@@ -58,31 +97,111 @@ uint8_t gateway_protocol_packet_decode (
 
     if (checkup_callback && checkup_callback(gwp_conf)) {
 	if (gwp_conf->secure) {
+	    /* whole blocks only, decrypted where they are */
+	    if ((packet_length - GATEWAY_PROTOCOL_APP_KEY_SIZE) % SECURITY_KEY_SIZE) {
+	        return 0;
+	    }
             security_adapter_decrypt(	gwp_conf->secure_key, 
 					&packet[GATEWAY_PROTOCOL_APP_KEY_SIZE], 
 					(packet_length-GATEWAY_PROTOCOL_APP_KEY_SIZE),
 					&packet[GATEWAY_PROTOCOL_APP_KEY_SIZE], 
-					(uint16_t *)&packet_length
+					&length
 	    );
+	    length += GATEWAY_PROTOCOL_APP_KEY_SIZE;
 	}
     }
 
     gwp_conf->dev_id = packet[p_len];
     p_len++;
 
-    if (packet_type) *packet_type = (gateway_protocol_packet_type_t) packet[p_len];
+    view->packet_type = (gateway_protocol_packet_type_t) packet[p_len];
     p_len++;
 
-    *payload_length = packet[p_len];
-    p_len++;
+    if (view->packet_type & GATEWAY_PROTOCOL_PACKET_TYPE_VARINT) {
+        view->packet_type = (gateway_protocol_packet_type_t) (view->packet_type & ~GATEWAY_PROTOCOL_PACKET_TYPE_VARINT);
+        if ((len_size = gateway_protocol_varint_decode(&view->payload_length, &packet[p_len], length - p_len)) <= 0) {
+            return 0;
+        }
+        p_len += len_size;
+    } else {
+        view->payload_length = packet[p_len];
+        p_len++;
+    }
 
-    memcpy(payload, &packet[p_len], *payload_length);
-    p_len += *payload_length;
+    if ((uint32_t)p_len + view->payload_length > length) {
+        return 0;
+    }
+
+    view->payload = &packet[p_len];
+    p_len += view->payload_length;
 
     return p_len;
 }
 
+int32_t gateway_protocol_packet_length (
+    const uint8_t *header,
+    const uint16_t header_length,
+    const uint8_t secure)
+{
+    uint16_t payload_length;
+    int32_t length;
+    int len_size = 1;
+
+    if (header_length < 3) {
+        return 0;
+    }
+
+    if (header[1] & GATEWAY_PROTOCOL_PACKET_TYPE_VARINT) {
+        if ((len_size = gateway_protocol_varint_decode(&payload_length, &header[2], header_length - 2)) <= 0) {
+            return len_size;
+        }
+    } else {
+        payload_length = header[2];
+    }
+
+    length = 2 + len_size + payload_length;
+    if (secure) {
+        length = (length + SECURITY_KEY_SIZE - 1) / SECURITY_KEY_SIZE * SECURITY_KEY_SIZE;
+    }
+
+    return GATEWAY_PROTOCOL_APP_KEY_SIZE + length;
+}
+
 void gateway_protocol_set_checkup_callback(gateway_protocol_checkup_callback_t callback) {
     checkup_callback = callback;
 }
 
+static uint8_t gateway_protocol_varint_encode(uint16_t value, uint8_t *buf) {
+    uint8_t size = 0;
+
+    while (value >= 0x80) {
+        buf[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = value;
+
+    return size;
+}
+
+/* returns the bytes read, 0 if buf ends before the varint, -1 if it
+ * is longer than GATEWAY_PROTOCOL_VARINT_SIZE_MAX or over 16 bits */
+static int gateway_protocol_varint_decode(uint16_t *value, const uint8_t *buf, uint16_t buf_length) {
+    uint32_t v = 0;
+    int i;
+
+    for (i = 0; i < GATEWAY_PROTOCOL_VARINT_SIZE_MAX; i++) {
+        if (i == buf_length) {
+            return 0;
+        }
+        v |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            if (v > UINT16_MAX) {
+                return -1;
+            }
+            *value = v;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
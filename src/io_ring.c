@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io_ring.h"
+
+#define IO_RING_DATA_NONE	UINT64_MAX	// completions not reported, of cancellations
+
+struct io_ring {
+	int			desc;
+
+	/* submission queue, tail is ours and published by io_ring_wait */
+	void			*sq_ptr;
+	size_t			sq_size;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	unsigned int		sq_queued;	// tail once published
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+
+	/* completion queue, head is ours */
+	void			*cq_ptr;
+	size_t			cq_size;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static int io_ring_setup(unsigned int entries, struct io_uring_params *p);
+static int io_ring_enter(int desc, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+			 void *arg, size_t arg_size);
+static int io_ring_probe(io_ring_t *ir);
+static struct io_uring_sqe * io_ring_get_sqe(io_ring_t *ir);
+
+
+io_ring_t * io_ring_create(const unsigned int entries) {
+	struct io_uring_params p;
+	io_ring_t *ir;
+	int err;
+
+	ir = (io_ring_t *)calloc(1, sizeof(io_ring_t));
+	if (!ir) {
+		return NULL;
+	}
+	ir->sq_ptr = ir->cq_ptr = ir->sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+	memset(&p, 0x0, sizeof(p));
+	if ((ir->desc = io_ring_setup(entries, &p)) < 0) {
+		free(ir);
+		return NULL;
+	}
+
+	/* completions are not dropped when the queue is full and waits take a
+	 * timeout, both needed by the loop */
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOTSUP;
+		goto error;
+	}
+
+	ir->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ir->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && ir->cq_size > ir->sq_size) {
+		ir->sq_size = ir->cq_size;
+	}
+
+	ir->sq_ptr = mmap(NULL, ir->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ir->desc, IORING_OFF_SQ_RING);
+	if (ir->sq_ptr == MAP_FAILED) {
+		goto error;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ir->cq_ptr = ir->sq_ptr;
+	} else if ((ir->cq_ptr = mmap(NULL, ir->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				      ir->desc, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		goto error;
+	}
+	ir->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ir->sqes = (struct io_uring_sqe *)mmap(NULL, ir->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					       ir->desc, IORING_OFF_SQES);
+	if (ir->sqes == MAP_FAILED) {
+		goto error;
+	}
+
+	ir->sq_head 	= (unsigned int *)((char *)ir->sq_ptr + p.sq_off.head);
+	ir->sq_tail 	= (unsigned int *)((char *)ir->sq_ptr + p.sq_off.tail);
+	ir->sq_array 	= (unsigned int *)((char *)ir->sq_ptr + p.sq_off.array);
+	ir->sq_mask 	= *(unsigned int *)((char *)ir->sq_ptr + p.sq_off.ring_mask);
+	ir->sq_entries 	= p.sq_entries;
+	ir->sq_queued 	= *ir->sq_tail;
+	ir->cq_head 	= (unsigned int *)((char *)ir->cq_ptr + p.cq_off.head);
+	ir->cq_tail 	= (unsigned int *)((char *)ir->cq_ptr + p.cq_off.tail);
+	ir->cq_mask 	= *(unsigned int *)((char *)ir->cq_ptr + p.cq_off.ring_mask);
+	ir->cqes 	= (struct io_uring_cqe *)((char *)ir->cq_ptr + p.cq_off.cqes);
+
+	if (io_ring_probe(ir)) {
+		goto error;
+	}
+
+	return ir;
+
+error:
+	err = errno;
+	io_ring_destroy(ir);
+	errno = err;
+	return NULL;
+}
+
+void io_ring_destroy(io_ring_t *ir) {
+	if (!ir) {
+		return;
+	}
+
+	if (ir->sqes != MAP_FAILED) {
+		munmap(ir->sqes, ir->sqes_size);
+	}
+	if (ir->cq_ptr != MAP_FAILED && ir->cq_ptr != ir->sq_ptr) {
+		munmap(ir->cq_ptr, ir->cq_size);
+	}
+	if (ir->sq_ptr != MAP_FAILED) {
+		munmap(ir->sq_ptr, ir->sq_size);
+	}
+	close(ir->desc);
+	free(ir);
+}
+
+int io_ring_accept(io_ring_t *ir, int desc, const uint8_t multishot, uint64_t data) {
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = io_ring_get_sqe(ir))) {
+		return -1;
+	}
+	sqe->opcode 		= IORING_OP_ACCEPT;
+	sqe->fd 		= desc;
+	sqe->accept_flags 	= SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->ioprio 		= multishot ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data 		= data;
+
+	return 0;
+}
+
+int io_ring_recv(io_ring_t *ir, int desc, void *buf, const unsigned int len, uint64_t data) {
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = io_ring_get_sqe(ir))) {
+		return -1;
+	}
+	sqe->opcode 	= IORING_OP_RECV;
+	sqe->fd 	= desc;
+	sqe->addr 	= (uint64_t)(uintptr_t)buf;
+	sqe->len 	= len;
+	sqe->user_data 	= data;
+
+	return 0;
+}
+
+int io_ring_read(io_ring_t *ir, int desc, void *buf, const unsigned int len, uint64_t data) {
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = io_ring_get_sqe(ir))) {
+		return -1;
+	}
+	sqe->opcode 	= IORING_OP_READ;
+	sqe->fd 	= desc;
+	sqe->addr 	= (uint64_t)(uintptr_t)buf;
+	sqe->len 	= len;
+	sqe->off 	= (uint64_t)-1;	// not seekable
+	sqe->user_data 	= data;
+
+	return 0;
+}
+
+int io_ring_cancel(io_ring_t *ir, uint64_t data) {
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = io_ring_get_sqe(ir))) {
+		return -1;
+	}
+	sqe->opcode 	= IORING_OP_ASYNC_CANCEL;
+	sqe->fd 	= -1;
+	sqe->addr 	= data;
+	sqe->user_data 	= IO_RING_DATA_NONE;
+
+	return 0;
+}
+
+int io_ring_wait(io_ring_t *ir, io_ring_event_t *events, const int events_max, const int timeout_ms) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail, to_submit;
+	int events_num = 0;
+
+	__atomic_store_n(ir->sq_tail, ir->sq_queued, __ATOMIC_RELEASE);
+	to_submit = ir->sq_queued - __atomic_load_n(ir->sq_head, __ATOMIC_ACQUIRE);
+
+	head = *ir->cq_head;
+	if (head == __atomic_load_n(ir->cq_tail, __ATOMIC_ACQUIRE)) {
+		memset(&arg, 0x0, sizeof(arg));
+		if (timeout_ms >= 0) {
+			ts.tv_sec 	= timeout_ms / 1000;
+			ts.tv_nsec 	= (long long)(timeout_ms % 1000) * 1000000;
+			arg.ts 		= (uint64_t)(uintptr_t)&ts;
+		}
+		/* a timeout or a signal end the wait with no completion */
+		if (io_ring_enter(ir->desc, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				  &arg, sizeof(arg)) < 0 && errno != ETIME) {
+			return -1;
+		}
+	} else if (to_submit && io_ring_enter(ir->desc, to_submit, 0, 0, NULL, 0) < 0) {
+		return -1;
+	}
+
+	tail = __atomic_load_n(ir->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail && events_num < events_max; head++) {
+		cqe = &ir->cqes[head & ir->cq_mask];
+		if (cqe->user_data == IO_RING_DATA_NONE) {
+			continue;
+		}
+		events[events_num].data = cqe->user_data;
+		events[events_num].res 	= cqe->res;
+		events[events_num].more = !!(cqe->flags & IORING_CQE_F_MORE);
+		events_num++;
+	}
+	__atomic_store_n(ir->cq_head, head, __ATOMIC_RELEASE);
+
+	return events_num;
+}
+
+static int io_ring_setup(unsigned int entries, struct io_uring_params *p) {
+#ifdef __NR_io_uring_setup
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int io_ring_enter(int desc, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+			 void *arg, size_t arg_size) {
+	return (int)syscall(__NR_io_uring_enter, desc, to_submit, min_complete, flags, arg, arg_size);
+}
+
+/* the operations queued by the functions above */
+static int io_ring_probe(io_ring_t *ir) {
+	static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_ASYNC_CANCEL};
+	struct io_uring_probe *probe;
+	size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	int ret = 0;
+
+	if (!(probe = (struct io_uring_probe *)calloc(1, size))) {
+		return -1;
+	}
+	if (syscall(__NR_io_uring_register, ir->desc, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+		free(probe);
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			errno = ENOTSUP;
+			ret = -1;
+			break;
+		}
+	}
+	free(probe);
+
+	return ret;
+}
+
+/* a cleared entry, the queued ones are submitted if none is left */
+static struct io_uring_sqe * io_ring_get_sqe(io_ring_t *ir) {
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (ir->sq_queued - __atomic_load_n(ir->sq_head, __ATOMIC_ACQUIRE) >= ir->sq_entries) {
+		__atomic_store_n(ir->sq_tail, ir->sq_queued, __ATOMIC_RELEASE);
+		if (io_ring_enter(ir->desc, ir->sq_entries, 0, 0, NULL, 0) < 0 ||
+		    ir->sq_queued - __atomic_load_n(ir->sq_head, __ATOMIC_ACQUIRE) >= ir->sq_entries) {
+			return NULL;
+		}
+	}
+
+	index = ir->sq_queued & ir->sq_mask;
+	sqe = &ir->sqes[index];
+	memset(sqe, 0x0, sizeof(*sqe));
+	ir->sq_array[index] = index;
+	ir->sq_queued++;
+
+	return sqe;
+}
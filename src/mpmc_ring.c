@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mpmc_ring.h"
+
+#define CACHE_LINE_SIZE		64
+
+typedef struct {
+	size_t 	seq;
+	void 	*data;
+} __attribute__((aligned(CACHE_LINE_SIZE))) mpmc_ring_slot_t;
+
+struct mpmc_ring {
+	mpmc_ring_slot_t 	*slots;
+	size_t 			mask;
+	char 			pad0[CACHE_LINE_SIZE - sizeof(mpmc_ring_slot_t *) - sizeof(size_t)];
+	size_t 			enqueue_pos;
+	char 			pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+	size_t 			dequeue_pos;
+	char 			pad2[CACHE_LINE_SIZE - sizeof(size_t)];
+};
+
+
+mpmc_ring_t * mpmc_ring_create(const unsigned int capacity) {
+	mpmc_ring_t *r;
+	size_t i, cap = 2;
+
+	while (cap < capacity) {
+		cap <<= 1;
+	}
+
+	if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(mpmc_ring_t))) {
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&r->slots, CACHE_LINE_SIZE, sizeof(mpmc_ring_slot_t) * cap)) {
+		free(r);
+		return NULL;
+	}
+
+	for (i = 0; i < cap; i++) {
+		r->slots[i].seq  = i;
+		r->slots[i].data = NULL;
+	}
+	r->mask 	= cap - 1;
+	r->enqueue_pos 	= 0;
+	r->dequeue_pos 	= 0;
+
+	return r;
+}
+
+void mpmc_ring_destroy(mpmc_ring_t *r) {
+	if (!r) {
+		return;
+	}
+	free(r->slots);
+	free(r);
+}
+
+int mpmc_ring_push(mpmc_ring_t *r, void *data) {
+	mpmc_ring_slot_t *slot;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &r->slots[pos & r->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0; // full
+		} else {
+			pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->data = data;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int mpmc_ring_pop(mpmc_ring_t *r, void **data) {
+	mpmc_ring_slot_t *slot;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &r->slots[pos & r->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0; // empty
+		} else {
+			pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	*data = slot->data;
+	__atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+unsigned int mpmc_ring_get_capacity(const mpmc_ring_t *r) {
+	return r->mask + 1;
+}
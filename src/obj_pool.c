@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "obj_pool.h"
+
+#define OBJ_POOL_ALIGN			16
+#define OBJ_POOL_MAGAZINE_SIZE_DEFAULT	64
+
+typedef struct obj_magazine {
+	struct obj_magazine 	*next;
+	unsigned int		count;
+	void			*objs[];
+} obj_magazine_t;
+
+typedef union obj_slab {
+	union obj_slab 		*next;
+	char			align[OBJ_POOL_ALIGN];
+} obj_slab_t; // header of a slab, objects follow
+
+typedef struct obj_cache {
+	obj_pool_t		*pool;
+	obj_magazine_t		*loaded;
+	struct obj_cache	*next;
+	struct obj_cache	*prev;
+} obj_cache_t;
+
+struct obj_pool {
+	size_t			obj_size;
+	unsigned int		magazine_size;
+	pthread_key_t		key;
+	pthread_mutex_t		mutex;
+	obj_magazine_t		*full;
+	obj_magazine_t		*empty;
+	obj_slab_t		*slabs;
+	obj_cache_t		*caches;
+	size_t			capacity;
+};
+
+static obj_magazine_t * obj_magazine_create(const obj_pool_t *pool);
+static obj_cache_t * obj_cache_get(obj_pool_t *pool);
+static void obj_cache_release(void *cache);
+static int obj_slab_carve(obj_pool_t *pool, obj_magazine_t *mag);
+
+
+obj_pool_t * obj_pool_create(const size_t obj_size, const unsigned int magazine_size) {
+	obj_pool_t *pool;
+
+	if (!obj_size) {
+		return NULL;
+	}
+
+	pool = (obj_pool_t *)malloc(sizeof(obj_pool_t));
+	if (!pool) {
+		return NULL;
+	}
+
+	if (pthread_key_create(&pool->key, obj_cache_release)) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->obj_size 		= (obj_size + OBJ_POOL_ALIGN - 1) & ~(size_t)(OBJ_POOL_ALIGN - 1);
+	pool->magazine_size	= magazine_size ? magazine_size : OBJ_POOL_MAGAZINE_SIZE_DEFAULT;
+	pool->full		= NULL;
+	pool->empty		= NULL;
+	pool->slabs		= NULL;
+	pool->caches		= NULL;
+	pool->capacity		= 0;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	return pool;
+}
+
+void obj_pool_destroy(obj_pool_t *pool) {
+	obj_magazine_t *mag;
+	obj_slab_t *slab;
+	obj_cache_t *cache;
+
+	if (!pool) {
+		return;
+	}
+
+	/* no more destructor calls from exiting threads */
+	pthread_key_delete(pool->key);
+
+	while ((cache = pool->caches)) {
+		pool->caches = cache->next;
+		free(cache->loaded);
+		free(cache);
+	}
+	while ((mag = pool->full)) {
+		pool->full = mag->next;
+		free(mag);
+	}
+	while ((mag = pool->empty)) {
+		pool->empty = mag->next;
+		free(mag);
+	}
+	while ((slab = pool->slabs)) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+void * obj_pool_alloc(obj_pool_t *pool) {
+	obj_cache_t *cache = obj_cache_get(pool);
+	obj_magazine_t *mag;
+
+	if (!cache) {
+		return NULL;
+	}
+
+	if (!cache->loaded->count) {
+		pthread_mutex_lock(&pool->mutex);
+		if ((mag = pool->full)) {
+			pool->full = mag->next;
+			cache->loaded->next = pool->empty;
+			pool->empty = cache->loaded;
+			cache->loaded = mag;
+		} else if (!obj_slab_carve(pool, cache->loaded)) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return cache->loaded->objs[--cache->loaded->count];
+}
+
+void obj_pool_free(obj_pool_t *pool, void *obj) {
+	obj_cache_t *cache;
+	obj_magazine_t *mag;
+
+	if (!obj || !(cache = obj_cache_get(pool))) {
+		return; // stays in its slab until the pool is destroyed
+	}
+
+	if (cache->loaded->count == pool->magazine_size) {
+		pthread_mutex_lock(&pool->mutex);
+		if ((mag = pool->empty)) {
+			pool->empty = mag->next;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (!mag && !(mag = obj_magazine_create(pool))) {
+			return;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		cache->loaded->next = pool->full;
+		pool->full = cache->loaded;
+		pthread_mutex_unlock(&pool->mutex);
+
+		cache->loaded = mag;
+	}
+
+	cache->loaded->objs[cache->loaded->count++] = obj;
+}
+
+size_t obj_pool_get_capacity(const obj_pool_t *pool) {
+	return __atomic_load_n(&pool->capacity, __ATOMIC_RELAXED);
+}
+
+static obj_magazine_t * obj_magazine_create(const obj_pool_t *pool) {
+	obj_magazine_t *mag;
+
+	mag = (obj_magazine_t *)malloc(sizeof(obj_magazine_t) + sizeof(void *) * pool->magazine_size);
+	if (!mag) {
+		return NULL;
+	}
+	mag->next	= NULL;
+	mag->count	= 0;
+
+	return mag;
+}
+
+static obj_cache_t * obj_cache_get(obj_pool_t *pool) {
+	obj_cache_t *cache = (obj_cache_t *)pthread_getspecific(pool->key);
+
+	if (cache) {
+		return cache;
+	}
+
+	cache = (obj_cache_t *)malloc(sizeof(obj_cache_t));
+	if (!cache) {
+		return NULL;
+	}
+
+	if (!(cache->loaded = obj_magazine_create(pool))) {
+		free(cache);
+		return NULL;
+	}
+	cache->pool = pool;
+	cache->prev = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if ((cache->next = pool->caches)) {
+		cache->next->prev = cache;
+	}
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_setspecific(pool->key, cache);
+
+	return cache;
+}
+
+/* thread exit, the objects cached by the thread go back to the pool */
+static void obj_cache_release(void *arg) {
+	obj_cache_t *cache = (obj_cache_t *)arg;
+	obj_pool_t *pool = cache->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (cache->loaded->count) {
+		cache->loaded->next = pool->full;
+		pool->full = cache->loaded;
+	} else {
+		cache->loaded->next = pool->empty;
+		pool->empty = cache->loaded;
+	}
+
+	if (cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		pool->caches = cache->next;
+	}
+	if (cache->next) {
+		cache->next->prev = cache->prev;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(cache);
+}
+
+/* fills an empty magazine from a new slab, called with the pool locked */
+static int obj_slab_carve(obj_pool_t *pool, obj_magazine_t *mag) {
+	obj_slab_t *slab;
+	char *obj;
+	unsigned int i;
+
+	slab = (obj_slab_t *)malloc(sizeof(obj_slab_t) + pool->obj_size * pool->magazine_size);
+	if (!slab) {
+		return 0;
+	}
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	obj = (char *)(slab + 1);
+	for (i = 0; i < pool->magazine_size; i++, obj += pool->obj_size) {
+		mag->objs[i] = obj;
+	}
+	mag->count = pool->magazine_size;
+
+	__atomic_add_fetch(&pool->capacity, pool->magazine_size, __ATOMIC_RELAXED);
+
+	return 1;
+}
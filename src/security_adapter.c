@@ -17,7 +17,9 @@ void security_adapter_encrypt(
 	}
 
 	*encrypted_payload_length = i;
-	memcpy(encrypted_payload, decrypted_payload, *encrypted_payload_length);
+	if (encrypted_payload != decrypted_payload) {
+		memcpy(encrypted_payload, decrypted_payload, *encrypted_payload_length);
+	}
 }
 
 
@@ -40,5 +42,7 @@ void security_adapter_decrypt(
 	}
 
 	*decrypted_payload_length = i;
-	memcpy(decrypted_payload, encrypted_payload, *decrypted_payload_length);
+	if (decrypted_payload != encrypted_payload) {
+		memcpy(decrypted_payload, encrypted_payload, *decrypted_payload_length);
+	}
 }
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+
+#include "task_pipeline.h"
+#include "obj_pool.h"
+
+typedef struct {
+	const char		*name;
+	task_stage_func_t	func;
+	task_stage_batch_func_t	batch_func;
+	task_queue_t		*tq;
+	int			owner;		// destroys tq
+} pipeline_stage_t;
+
+/* a job argument on its way through the stages */
+typedef struct {
+	task_pipeline_t		*pl;
+	int			stage;
+	void			*arg;
+	task_job_attr_t		jattr;
+} pipeline_job_t;
+
+struct task_pipeline {
+	pipeline_stage_t		*stages;
+	int				stages_num;
+	task_pipeline_drop_func_t	drop_func;
+	obj_pool_t			*job_pool;
+};
+
+static int pipeline_job_enqueue(task_pipeline_t *pl, pipeline_job_t *pj);
+static void pipeline_job_drop(task_pipeline_t *pl, pipeline_job_t *pj);
+static void pipeline_stage_run(void *arg);
+static void pipeline_stage_run_batch(void **args, int count);
+static void pipeline_queue_drop(task_func_t task, void *arg);
+
+
+void task_stage_attr_init(task_stage_attr_t *attr) {
+	if (!attr) {
+		return;
+	}
+	attr->name		= NULL;
+	attr->func		= NULL;
+	attr->batch_func	= NULL;
+	attr->queue_stage	= -1;
+	task_queue_attr_init(&attr->queue_attr);
+}
+
+task_pipeline_t * task_pipeline_create(const task_stage_attr_t *stages, const int stages_num,
+				       task_pipeline_drop_func_t drop_func) {
+	task_pipeline_t *pl;
+	task_queue_attr_t qattr;
+	int i;
+
+	if (!stages || stages_num <= 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < stages_num; i++) {
+		if ((!stages[i].func && !stages[i].batch_func) || stages[i].queue_stage >= i) {
+			return NULL;
+		}
+	}
+
+	pl = (task_pipeline_t *)calloc(1, sizeof(task_pipeline_t));
+	if (!pl) {
+		return NULL;
+	}
+
+	pl->stages = (pipeline_stage_t *)calloc(stages_num, sizeof(pipeline_stage_t));
+	pl->job_pool = obj_pool_create(sizeof(pipeline_job_t), 0);
+	if (!pl->stages || !pl->job_pool) {
+		task_pipeline_destroy(pl);
+		return NULL;
+	}
+	pl->stages_num	= stages_num;
+	pl->drop_func	= drop_func;
+
+	for (i = 0; i < stages_num; i++) {
+		pl->stages[i].name 		= stages[i].name;
+		pl->stages[i].func 		= stages[i].func;
+		pl->stages[i].batch_func 	= stages[i].batch_func;
+
+		if (stages[i].queue_stage >= 0) {
+			pl->stages[i].tq = pl->stages[stages[i].queue_stage].tq;
+			continue;
+		}
+
+		qattr = stages[i].queue_attr;
+		qattr.drop_func = pipeline_queue_drop;
+		if (!(pl->stages[i].tq = task_queue_create_attr(&qattr))) {
+			task_pipeline_destroy(pl);
+			return NULL;
+		}
+		pl->stages[i].owner = 1;
+	}
+
+	return pl;
+}
+
+void task_pipeline_destroy(task_pipeline_t *pl) {
+	int i;
+
+	if (!pl) {
+		return;
+	}
+
+	for (i = 0; pl->stages && i < pl->stages_num; i++) {
+		if (pl->stages[i].owner) {
+			task_queue_destroy(pl->stages[i].tq);
+		}
+	}
+
+	obj_pool_destroy(pl->job_pool);
+	free(pl->stages);
+	free(pl);
+}
+
+int task_pipeline_submit(task_pipeline_t *pl, void *arg, const task_job_attr_t *jattr) {
+	return task_pipeline_submit_at(pl, 0, arg, jattr);
+}
+
+int task_pipeline_submit_at(task_pipeline_t *pl, const int stage, void *arg, const task_job_attr_t *jattr) {
+	pipeline_job_t *pj;
+	int ret;
+
+	if (!pl || stage < 0 || stage >= pl->stages_num) {
+		return TASK_QUEUE_ERR;
+	}
+
+	if (!(pj = (pipeline_job_t *)obj_pool_alloc(pl->job_pool))) {
+		return TASK_QUEUE_ERR;
+	}
+	pj->pl 		= pl;
+	pj->stage 	= stage;
+	pj->arg 	= arg;
+	if (jattr) {
+		pj->jattr = *jattr;
+	} else {
+		task_job_attr_init(&pj->jattr);
+	}
+
+	if ((ret = pipeline_job_enqueue(pl, pj)) < 0) {
+		obj_pool_free(pl->job_pool, pj);
+	}
+
+	return ret;
+}
+
+int task_pipeline_submit_delayed(task_pipeline_t *pl, const int stage, void *arg, const task_job_attr_t *jattr,
+				 const unsigned int delay_ms) {
+	pipeline_job_t *pj;
+
+	if (!pl || stage < 0 || stage >= pl->stages_num || pl->stages[stage].batch_func) {
+		return TASK_QUEUE_ERR;
+	}
+
+	if (!(pj = (pipeline_job_t *)obj_pool_alloc(pl->job_pool))) {
+		return TASK_QUEUE_ERR;
+	}
+	pj->pl 		= pl;
+	pj->stage 	= stage;
+	pj->arg 	= arg;
+	if (jattr) {
+		pj->jattr = *jattr;
+	} else {
+		task_job_attr_init(&pj->jattr);
+	}
+
+	if (task_queue_enqueue_delayed(pl->stages[stage].tq, pipeline_stage_run, pj, &pj->jattr, delay_ms) < 0) {
+		obj_pool_free(pl->job_pool, pj);
+		return TASK_QUEUE_ERR;
+	}
+
+	return 0;
+}
+
+int task_pipeline_get_stages_num(const task_pipeline_t *pl) {
+	return pl->stages_num;
+}
+
+const char * task_pipeline_get_stage_name(const task_pipeline_t *pl, const int stage) {
+	if (stage < 0 || stage >= pl->stages_num) {
+		return NULL;
+	}
+	return pl->stages[stage].name;
+}
+
+task_queue_t * task_pipeline_get_queue(const task_pipeline_t *pl, const int stage) {
+	if (stage < 0 || stage >= pl->stages_num) {
+		return NULL;
+	}
+	return pl->stages[stage].tq;
+}
+
+static int pipeline_job_enqueue(task_pipeline_t *pl, pipeline_job_t *pj) {
+	pipeline_stage_t *ps = &pl->stages[pj->stage];
+
+	if (ps->batch_func) {
+		return task_queue_enqueue_batchable(ps->tq, pipeline_stage_run_batch, pj, &pj->jattr);
+	}
+
+	return task_queue_enqueue_attr(ps->tq, pipeline_stage_run, pj, &pj->jattr);
+}
+
+static void pipeline_job_drop(task_pipeline_t *pl, pipeline_job_t *pj) {
+	if (pl->drop_func) {
+		pl->drop_func(pj->arg, pj->stage);
+	}
+	obj_pool_free(pl->job_pool, pj);
+}
+
+static void pipeline_stage_run(void *arg) {
+	pipeline_job_t *pj = (pipeline_job_t *)arg;
+	task_pipeline_t *pl = pj->pl;
+	int next;
+
+	next = pl->stages[pj->stage].func(pj->arg, &pj->jattr);
+
+	if (next == TASK_STAGE_NEXT) {
+		next = pj->stage + 1;
+	}
+
+	if (next < 0 || next >= pl->stages_num) {
+		obj_pool_free(pl->job_pool, pj);
+		return;
+	}
+
+	pj->stage = next;
+	if (pipeline_job_enqueue(pl, pj) < 0) {
+		pipeline_job_drop(pl, pj);
+	}
+}
+
+/* batching stages sharing a queue may have their jobs in the same batch,
+ * each stage is handed its own arguments in their order */
+static void pipeline_stage_run_batch(void **args, int count) {
+	pipeline_job_t *pj;
+	task_pipeline_t *pl;
+	int i, j, n, stage;
+
+	while (count) {
+		pj 	= (pipeline_job_t *)args[0];
+		pl 	= pj->pl;
+		stage 	= pj->stage;
+
+		/* the arguments of stage move to the front, both groups keep their order */
+		for (i = 0, n = 0; i < count; i++) {
+			pj = (pipeline_job_t *)args[i];
+			if (pj->stage == stage) {
+				for (j = i; j > n; j--) {
+					args[j] = args[j - 1];
+				}
+				args[n++] = pj;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			pj = (pipeline_job_t *)args[i];
+			args[i] = pj->arg;
+			obj_pool_free(pl->job_pool, pj);
+		}
+
+		pl->stages[stage].batch_func(args, n);
+
+		args  += n;
+		count -= n;
+	}
+}
+
+static void pipeline_queue_drop(task_func_t task, void *arg) {
+	pipeline_job_t *pj = (pipeline_job_t *)arg;
+
+	(void)task;
+	pipeline_job_drop(pj->pl, pj);
+}
@@ -1,119 +1,740 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
 
 #include "task_queue.h"
+#include "mpmc_ring.h"
+#include "ws_deque.h"
+#include "obj_pool.h"
+#include "timer_wheel.h"
+
+#define TASK_QUEUE_RING_CAPACITY_DEFAULT	1024
+#define TASK_QUEUE_DEQUE_CAPACITY		256
+#define TASK_QUEUE_BLOCK_WAIT_NS		10000000
+#define TASK_QUEUE_JOB_MAGAZINE_SIZE		64
+#define TASK_QUEUE_STRAND_BUCKETS		256
+#define TASK_QUEUE_FLOW_BUCKETS			64
+#define TASK_QUEUE_TIMER_TICK_MS_DEFAULT	10
+
+struct queue_strand;
+struct queue_flow;
 
 struct queue_job {
 	task_func_t 		func;
+	task_batch_func_t	batch_func;	// set instead of func for batchable jobs
 	void 			*arg;
+	int			prio;
+	int			hint;
+	int			token;		// stands in the store for a job of a flow
+	uint64_t		enqueue_ns;
+	uint64_t		deadline_ns;
+	struct queue_strand	*strand;	// keyed jobs, the strand they hold
+	struct queue_flow	*flow;
+	struct task_future	*future;	// completed instead of calling drop_func
 	struct queue_job 	*next;
 };
 typedef struct queue_job queue_job_t;
 
-struct task_queue {
+/* Jobs sharing a key. The strand exists while one of its jobs is in the
+ * store or running, the following ones wait on its backlog and enter
+ * the store one at a time as the previous one leaves it.
+ */
+typedef struct queue_strand {
+	long			key;
+	queue_job_t		*next;		// backlog
+	queue_job_t		*last;
+	struct queue_strand	*bucket_next;
+} queue_strand_t;
+
+typedef struct {
+	pthread_mutex_t		mutex;
+	queue_strand_t		*strands;
+} queue_strand_bucket_t;
+
+/* jobs of a flow in one lane */
+typedef struct {
+	queue_job_t		*next;
+	queue_job_t		*last;
+	int			jobs;
+	int			deficit;	// jobs left in the current round
+	struct queue_flow	*active_next;
+} queue_flow_lane_t;
+
+/* Jobs sharing a flow wait in the flow and a token takes their place in
+ * the store. Whichever job a token is taken for, the lane hands out the
+ * job of the flow deficit round robin elects, so a flow gets its weight
+ * in jobs per round and the store keeps its order with the other jobs.
+ */
+typedef struct queue_flow {
+	long			id;
+	int			weight;
+	queue_flow_lane_t	lanes[TASK_QUEUE_PRIO_NUM];
+	struct queue_flow	*bucket_next;
+} queue_flow_t;
+
+typedef struct {
+	pthread_mutex_t		mutex;
+	queue_flow_t		*flows;
+} queue_flow_bucket_t;
+
+/* a job waiting for its delay to elapse before being queued */
+typedef struct {
+	timer_entry_t		te;
+	task_queue_t		*tq;
+	task_func_t		func;
+	void			*arg;
+	task_job_attr_t		jattr;
+} queue_delayed_t;
+
+/* the queue and the caller hold a reference each, the queue drops its
+ * one on completion */
+struct task_future {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	int			state;
+	int			refs;
+	task_future_func_t	func;
+	void			*arg;
+	void			*result;
+	task_future_then_t	then;
+	void			*then_arg;
+};
+
+/* per priority store shared by all workers */
+typedef struct {
+	/* TASK_QUEUE_BACKEND_LIST store */
 	queue_job_t 	*next;
 	queue_job_t 	*last;
+	pthread_mutex_t list_mutex;
+
+	/* TASK_QUEUE_BACKEND_RING store */
+	mpmc_ring_t	*ring;
+
+	int		pending;	// jobs stored and not yet taken by a worker
+	int		pending_hwm;
+	int		weight;		// TASK_QUEUE_SCHED_WEIGHTED share
+
+	/* flows with jobs in the lane, served in turn */
+	pthread_mutex_t fair_mutex;
+	queue_flow_t	*flows;
+	queue_flow_t	*flows_last;
+} queue_lane_t;
+
+/* per priority store of a worker, TASK_QUEUE_BACKEND_STEAL */
+typedef struct {
+	ws_deque_t	*deque;		// owner push/pop, others steal
+	queue_job_t	*inbox_next;	// jobs submitted by non-worker threads
+	queue_job_t	*inbox_last;
+	pthread_mutex_t inbox_mutex;
+} queue_worker_lane_t;
+
+typedef struct {
+	task_queue_t		*tq;
+	pthread_t		thread;
+	int			id;
+	queue_worker_lane_t	lanes[TASK_QUEUE_PRIO_NUM];
+	int			credit[TASK_QUEUE_PRIO_NUM];	// smooth weighted round robin state
+	void			**batch;	// batch_max arguments
+	queue_strand_t		**batch_strands;
+
+	/* written by the worker only, read by task_queue_get_metrics */
+	task_queue_hist_t	wait;
+	task_queue_hist_t	service;
+} queue_worker_t;
+
+struct task_queue {
+	task_queue_backend_t 	backend;
+	task_queue_sched_t	sched;
+	queue_lane_t		lanes[TASK_QUEUE_PRIO_NUM];
+
+	/* workers parking */
 	pthread_mutex_t mutex;
+	pthread_cond_t	cond;		// signalled on new jobs, unsuspend and destroy
+	int		idle_workers;
+	pthread_cond_t	limit_cond;	// signalled when limit is raised and on destroy
+	int		limit;		// workers with a lower id take jobs
+
+	/* overflow handling */
+	int			max_size;
+	task_queue_overflow_t	overflow;
+	task_drop_func_t	drop_func;
+	pthread_cond_t		space_cond;	// signalled when a job leaves the store
+	int			blocked_producers;
+	unsigned long long	rejected;
+	unsigned long long	dropped;
+	unsigned long long	blocked;
+	unsigned long long	expired;
+
+	/* batch consumer mode */
+	int			batch_max;
+	long			batch_wait_us;
+	pthread_cond_t		batch_cond;	// signalled on new jobs while a batch is filling
+	int			batch_waiters;
+
+	obj_pool_t		*job_pool;	// queue_job_t, freed on other threads than allocated
+
+	/* keyed jobs */
+	queue_strand_bucket_t	strand_buckets[TASK_QUEUE_STRAND_BUCKETS];
+	obj_pool_t		*strand_pool;
+	int			deferred;	// jobs waiting on a strand backlog
+
+	/* fair queueing */
+	queue_flow_bucket_t	flow_buckets[TASK_QUEUE_FLOW_BUCKETS];
+	obj_pool_t		*flow_pool;
+
+	/* delayed jobs, the wheel and its thread start with the first one */
+	pthread_mutex_t		timers_mutex;
+	timer_wheel_t		*timers;
+	obj_pool_t		*delayed_pool;
+	unsigned int		timer_tick_ms;
+	int			timers_closed;
+	int			delayed;
+
+	queue_worker_t	*workers;
+	int		workers_num;
+	unsigned int	rr_next;	// round robin dispatch for TASK_QUEUE_BACKEND_STEAL
+	int		pending;	// jobs stored and not yet taken by a worker
 	int 		active_tasks;
-	int 		size;
+	int 		size;		// pending and running jobs
+	int		size_hwm;
+	int		pending_hwm;
+	int		active_hwm;
 	int 		suspended;
+	int		shutdown;
 };
 
-static int max_active_tasks;
+/* worker the calling thread belongs to, NULL for foreign threads */
+static __thread queue_worker_t *current_worker = NULL;
+
+static queue_job_t * queue_job_create(task_queue_t *tq, task_func_t func, task_batch_func_t batch_func, void *arg);
+static void queue_job_destroy(task_queue_t *tq, queue_job_t *qj);
+static int queue_job_enqueue(task_queue_t *tq, queue_job_t *qj, const task_job_attr_t *jattr);
+static int queue_job_run(task_queue_t *tq, queue_worker_t *qw, queue_job_t *qj);
+static uint64_t queue_now_ns(void);
+static void queue_hist_add(task_queue_hist_t *hist, const uint64_t ns);
+static void queue_hist_merge(task_queue_hist_t *dst, const task_queue_hist_t *src);
+static void queue_hwm_update(int *hwm, const int value);
+static int queue_job_run_batch(task_queue_t *tq, queue_worker_t *qw, queue_job_t *qj);
+static int queue_batch_wait(task_queue_t *tq, const int prio, const struct timespec *deadline);
+static void queue_space_notify(task_queue_t *tq);
+static int queue_slot_reserve(task_queue_t *tq);
+static int queue_space_wait(task_queue_t *tq);
+static int queue_job_shed(task_queue_t *tq, const int prio);
+static int queue_is_full(task_queue_t *tq, const int pending);
+static void queue_job_drop(task_queue_t *tq, queue_job_t *qj);
+static void queue_job_discard(task_queue_t *tq, queue_job_t *qj);
+static void queue_job_expire(task_queue_t *tq, queue_job_t *qj);
+static int queue_job_put(task_queue_t *tq, queue_job_t *qj);
+static int queue_store_put(task_queue_t *tq, queue_job_t *qj);
+static queue_flow_t * queue_flow_get(task_queue_t *tq, const long id);
+static queue_job_t * queue_flow_take(task_queue_t *tq, const int prio, const int longest);
+static int queue_strand_admit(task_queue_t *tq, queue_job_t *qj, const long key);
+static void queue_strand_release(task_queue_t *tq, queue_strand_t *strand);
+static int queue_timers_start(task_queue_t *tq);
+static void queue_delayed_fire(void *arg);
+static void queue_delayed_discard(void *arg);
+static task_future_t * queue_future_create(task_future_func_t func, void *arg);
+static void queue_future_free(task_future_t *fut);
+static void queue_future_run(void *arg);
+static void queue_future_complete(task_future_t *fut, const int state, void *result);
+static queue_job_t * queue_job_get_next(task_queue_t *tq, queue_worker_t *qw);
+static int queue_lanes_order(task_queue_t *tq, queue_worker_t *qw, int *order);
+static queue_job_t * queue_lane_take(task_queue_t *tq, queue_worker_t *qw, const int prio);
+static queue_job_t * queue_lane_pop(task_queue_t *tq, queue_worker_t *qw, const int prio);
+static queue_job_t * queue_job_steal(task_queue_t *tq, queue_worker_t *qw, const int prio);
+static void queue_inbox_put(queue_worker_lane_t *wl, queue_job_t *qj);
+static queue_job_t * queue_inbox_take(queue_worker_lane_t *wl);
+static queue_job_t * queue_inbox_take_oldest(task_queue_t *tq, const int prio);
+static void queue_workers_wakeup(task_queue_t *tq, int all);
+static void queue_worker_retire(task_queue_t *tq, queue_worker_t *qw);
+static void queue_workers_release(task_queue_t *tq, int workers_num);
+static void * queue_worker(void *arg_qw);
 
-static queue_job_t * queue_job_create(task_func_t func, void *arg);
-static void queue_job_destroy(queue_job_t *qj);
-static queue_job_t * queue_job_get_next(task_queue_t *tq);
-static void * queue_job_exec(void *arg_tq);
 
 
+void task_queue_attr_init(task_queue_attr_t *attr) {
+	int i;
+
+	if (!attr) {
+		return;
+	}
+	attr->max_threads 	= 1;
+	attr->backend 		= TASK_QUEUE_BACKEND_LIST;
+	attr->capacity 		= TASK_QUEUE_RING_CAPACITY_DEFAULT;
+	attr->sched		= TASK_QUEUE_SCHED_STRICT;
+	for (i = 0; i < TASK_QUEUE_PRIO_NUM; i++) {
+		attr->weights[i] = 1 << (TASK_QUEUE_PRIO_NUM - 1 - i);
+	}
+	attr->max_size		= 0;
+	attr->overflow		= TASK_QUEUE_OVERFLOW_REJECT;
+	attr->drop_func		= NULL;
+	attr->batch_max		= 1;
+	attr->batch_wait_us	= 0;
+	attr->timer_tick_ms	= TASK_QUEUE_TIMER_TICK_MS_DEFAULT;
+}
+
+void task_job_attr_init(task_job_attr_t *jattr) {
+	if (!jattr) {
+		return;
+	}
+	jattr->hint = TASK_JOB_HINT_NONE;
+	jattr->prio = TASK_QUEUE_PRIO_NORMAL;
+	jattr->key  = TASK_JOB_KEY_NONE;
+	jattr->flow = TASK_JOB_FLOW_NONE;
+	jattr->deadline_ns = 0;
+}
 
 task_queue_t * task_queue_create(const int max_threads) {
-	task_queue_t *tq = (task_queue_t *)malloc(sizeof(task_queue_t));
+	task_queue_attr_t attr;
+
+	task_queue_attr_init(&attr);
+	attr.max_threads = max_threads;
+
+	return task_queue_create_attr(&attr);
+}
 
+task_queue_t * task_queue_create_attr(const task_queue_attr_t *attr) {
+	task_queue_t *tq;
+	queue_worker_t *qw;
+	queue_lane_t *lane;
+	int i, p, workers_num;
+
+	if (!attr) {
+		return NULL;
+	}
+
+	tq = (task_queue_t *)calloc(1, sizeof(task_queue_t));
 	if (!tq) {
 		return NULL;
 	}
 
-	tq->next 		= NULL;
-	tq->last 		= NULL;
+	workers_num = attr->max_threads > 0 ? attr->max_threads : 1;
+
+	tq->workers = (queue_worker_t *)calloc(workers_num, sizeof(queue_worker_t));
+	if (!tq->workers) {
+		free(tq);
+		return NULL;
+	}
+
+	tq->backend 		= attr->backend;
+	tq->sched		= attr->sched;
+	tq->idle_workers	= 0;
+	tq->workers_num		= workers_num;
+	tq->limit		= workers_num;
+	tq->rr_next		= 0;
+	tq->pending		= 0;
 	tq->active_tasks 	= 0;
 	tq->size	 	= 0;
+	tq->size_hwm		= 0;
+	tq->pending_hwm		= 0;
+	tq->active_hwm		= 0;
 	tq->suspended 		= 0;
+	tq->shutdown		= 0;
+	tq->max_size		= attr->max_size > 0 ? attr->max_size : 0;
+	tq->overflow		= attr->overflow;
+	tq->drop_func		= attr->drop_func;
+	tq->blocked_producers	= 0;
+	tq->rejected		= 0;
+	tq->dropped		= 0;
+	tq->blocked		= 0;
+	tq->expired		= 0;
+	tq->batch_max		= attr->batch_max > 1 ? attr->batch_max : 1;
+	tq->batch_wait_us	= attr->batch_wait_us > 0 ? attr->batch_wait_us : 0;
+	tq->batch_waiters	= 0;
+	tq->deferred		= 0;
+	tq->timers		= NULL;
+	tq->timers_closed	= 0;
+	tq->delayed_pool	= NULL;
+	tq->timer_tick_ms	= attr->timer_tick_ms > 0 ? attr->timer_tick_ms : TASK_QUEUE_TIMER_TICK_MS_DEFAULT;
+	tq->delayed		= 0;
+
 	pthread_mutex_init(&(tq->mutex), NULL);
-	
-	max_active_tasks = max_threads > 0 ? max_threads : 1;
+	pthread_mutex_init(&(tq->timers_mutex), NULL);
+	pthread_cond_init(&(tq->cond), NULL);
+	pthread_cond_init(&(tq->space_cond), NULL);
+	pthread_cond_init(&(tq->limit_cond), NULL);
+
+	pthread_condattr_t cattr;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(tq->batch_cond), &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+		lane = &tq->lanes[p];
+		lane->next 	= NULL;
+		lane->last 	= NULL;
+		lane->ring 	= NULL;
+		lane->pending 	= 0;
+		lane->pending_hwm	= 0;
+		lane->weight	= attr->weights[p] > 0 ? attr->weights[p] : 1;
+		lane->flows	= NULL;
+		lane->flows_last	= NULL;
+		pthread_mutex_init(&(lane->list_mutex), NULL);
+		pthread_mutex_init(&(lane->fair_mutex), NULL);
+	}
+
+	for (i = 0; i < TASK_QUEUE_STRAND_BUCKETS; i++) {
+		tq->strand_buckets[i].strands = NULL;
+		pthread_mutex_init(&(tq->strand_buckets[i].mutex), NULL);
+	}
+
+	for (i = 0; i < TASK_QUEUE_FLOW_BUCKETS; i++) {
+		tq->flow_buckets[i].flows = NULL;
+		pthread_mutex_init(&(tq->flow_buckets[i].mutex), NULL);
+	}
+
+	/* every worker is set up before any of them starts stealing */
+	for (i = 0; i < workers_num; i++) {
+		qw = &tq->workers[i];
+		qw->tq 	= tq;
+		qw->id 	= i;
+		for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+			pthread_mutex_init(&(qw->lanes[p].inbox_mutex), NULL);
+		}
+	}
+
+	if (!(tq->job_pool = obj_pool_create(sizeof(queue_job_t), TASK_QUEUE_JOB_MAGAZINE_SIZE)) ||
+	    !(tq->strand_pool = obj_pool_create(sizeof(queue_strand_t), 0)) ||
+	    !(tq->flow_pool = obj_pool_create(sizeof(queue_flow_t), 0))) {
+		queue_workers_release(tq, 0);
+		return NULL;
+	}
+
+	for (i = 0; i < workers_num; i++) {
+		if (!(tq->workers[i].batch = (void **)malloc(sizeof(void *) * tq->batch_max)) ||
+		    !(tq->workers[i].batch_strands = (queue_strand_t **)malloc(sizeof(queue_strand_t *) * tq->batch_max))) {
+			queue_workers_release(tq, 0);
+			return NULL;
+		}
+	}
+
+	for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+		if (tq->backend == TASK_QUEUE_BACKEND_RING &&
+		    !(tq->lanes[p].ring = mpmc_ring_create(attr->capacity > 0 ? attr->capacity : TASK_QUEUE_RING_CAPACITY_DEFAULT))) {
+			queue_workers_release(tq, 0);
+			return NULL;
+		}
+
+		for (i = 0; i < workers_num && tq->backend == TASK_QUEUE_BACKEND_STEAL; i++) {
+			if (!(tq->workers[i].lanes[p].deque = ws_deque_create(TASK_QUEUE_DEQUE_CAPACITY))) {
+				queue_workers_release(tq, 0);
+				return NULL;
+			}
+		}
+	}
+
+	/* the pool is spawned once, workers sleep on the condition variable
+	 * while the queue is empty */
+	for (i = 0; i < workers_num; i++) {
+		if (pthread_create(&(tq->workers[i].thread), NULL, queue_worker, &tq->workers[i])) {
+			// perror("new thread creation error");
+			__atomic_store_n(&tq->shutdown, 1, __ATOMIC_SEQ_CST);
+			queue_workers_wakeup(tq, 1);
+			queue_workers_release(tq, i);
+			return NULL;
+		}
+	}
 
 	return tq;
 }
 
 void task_queue_destroy(task_queue_t *tq) {
-	queue_job_t *qj1, *qj2;
+	queue_job_t *qj;
+	int i;
 
 	if (!tq) {
-		return; 
+		return;
 	}
-	
-	pthread_mutex_lock(&(tq->mutex));	
-	tq->suspended = 1;
 
-	qj1 = tq->next;
-	while (qj1) {
-		qj2 = qj1->next;
-		queue_job_destroy(qj1);
-		qj1 = qj2;
+	/* delayed jobs are discarded first, the wheel would queue them */
+	pthread_mutex_lock(&(tq->timers_mutex));
+	tq->timers_closed = 1;
+	pthread_mutex_unlock(&(tq->timers_mutex));
+
+	timer_wheel_destroy(tq->timers, queue_delayed_discard);
+	obj_pool_destroy(tq->delayed_pool);
+
+	__atomic_store_n(&tq->suspended, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&tq->shutdown, 1, __ATOMIC_SEQ_CST);
+	queue_workers_wakeup(tq, 1);
+
+	pthread_mutex_lock(&(tq->mutex));
+	pthread_cond_broadcast(&(tq->space_cond));
+	pthread_cond_broadcast(&(tq->batch_cond));
+	pthread_cond_broadcast(&(tq->limit_cond));
+	pthread_mutex_unlock(&(tq->mutex));
+
+	/* running jobs are completed, pending ones are discarded */
+	for (i = 0; i < tq->workers_num; i++) {
+		pthread_join(tq->workers[i].thread, NULL);
 	}
 
-	pthread_mutex_destroy(&(tq->mutex));
+	for (i = 0; i < tq->workers_num; i++) {
+		while ((qj = queue_job_get_next(tq, &tq->workers[i]))) {
+			queue_job_drop(tq, qj);
+		}
+	}
 
-	free(tq);	
+	queue_workers_release(tq, 0);
 }
 
 int task_queue_enqueue(task_queue_t *tq, task_func_t task, void *arg) {
+	return task_queue_enqueue_attr(tq, task, arg, NULL);
+}
+
+int task_queue_enqueue_attr(task_queue_t *tq, task_func_t task, void *arg, const task_job_attr_t *jattr) {
 	queue_job_t *qj;
-	pthread_t thread;
-	int i, can_run, need_run, run, ret;
 
 	if (!tq || !task) {
-		return -1;
+		return TASK_QUEUE_ERR;
+	}
+
+	if (jattr && (jattr->prio < 0 || jattr->prio >= TASK_QUEUE_PRIO_NUM)) {
+		return TASK_QUEUE_ERR;
 	}
-	
-	qj = queue_job_create(task, arg);
+
+	qj = queue_job_create(tq, task, NULL, arg);
 
 	if (!qj) {
-		return -1;
+		return TASK_QUEUE_ERR;
 	}
 
-	pthread_mutex_lock(&(tq->mutex));
-	if (!tq->next) {
-		tq->next = qj;
-		tq->last = qj;
+	return queue_job_enqueue(tq, qj, jattr);
+}
+
+int task_queue_enqueue_batchable(task_queue_t *tq, task_batch_func_t batch, void *arg, const task_job_attr_t *jattr) {
+	queue_job_t *qj;
+
+	if (!tq || !batch) {
+		return TASK_QUEUE_ERR;
+	}
+
+	if (jattr && (jattr->prio < 0 || jattr->prio >= TASK_QUEUE_PRIO_NUM)) {
+		return TASK_QUEUE_ERR;
+	}
+
+	qj = queue_job_create(tq, NULL, batch, arg);
+
+	if (!qj) {
+		return TASK_QUEUE_ERR;
+	}
+
+	return queue_job_enqueue(tq, qj, jattr);
+}
+
+int task_queue_enqueue_delayed(task_queue_t *tq, task_func_t task, void *arg, const task_job_attr_t *jattr,
+			       const unsigned int delay_ms) {
+	queue_delayed_t *qd;
+
+	if (!tq || !task || __atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST)) {
+		return TASK_QUEUE_ERR;
+	}
+
+	if (jattr && (jattr->prio < 0 || jattr->prio >= TASK_QUEUE_PRIO_NUM)) {
+		return TASK_QUEUE_ERR;
+	}
+
+	pthread_mutex_lock(&(tq->timers_mutex));
+	if (!queue_timers_start(tq) || !(qd = (queue_delayed_t *)obj_pool_alloc(tq->delayed_pool))) {
+		pthread_mutex_unlock(&(tq->timers_mutex));
+		return TASK_QUEUE_ERR;
+	}
+
+	timer_entry_init(&qd->te, queue_delayed_fire, qd);
+	qd->tq 		= tq;
+	qd->func 	= task;
+	qd->arg 	= arg;
+	if (jattr) {
+		qd->jattr = *jattr;
 	} else {
-		tq->last->next 	= qj; // assign next
-		tq->last 	= qj; // move pointer
+		task_job_attr_init(&qd->jattr);
 	}
 
-	tq->size++;
+	__atomic_add_fetch(&tq->delayed, 1, __ATOMIC_RELAXED);
+	timer_wheel_add(tq->timers, &qd->te, delay_ms);
+	pthread_mutex_unlock(&(tq->timers_mutex));
 
-	if ((tq->active_tasks < max_active_tasks) & !tq->suspended) {
-		can_run = max_active_tasks - tq->active_tasks;
-		need_run = tq->size - tq->active_tasks;
-		run = need_run < can_run ? need_run : can_run;		
+	return 0;
+}
 
-		for (i = 0; i < run; i++) {
-			if (pthread_create(&thread, NULL, queue_job_exec, tq) < 0) {
-				// perror("new thread creation error");
-			} else {
-				pthread_detach(thread);
-				tq->active_tasks++;
+task_future_t * task_queue_enqueue_future(task_queue_t *tq, task_future_func_t task, void *arg,
+					  const task_job_attr_t *jattr) {
+	task_future_t *fut;
+	queue_job_t *qj;
+
+	if (!tq || !task) {
+		return NULL;
+	}
+
+	if (jattr && (jattr->prio < 0 || jattr->prio >= TASK_QUEUE_PRIO_NUM)) {
+		return NULL;
+	}
+
+	if (!(fut = queue_future_create(task, arg))) {
+		return NULL;
+	}
+
+	if (!(qj = queue_job_create(tq, queue_future_run, NULL, fut))) {
+		queue_future_free(fut);
+		return NULL;
+	}
+	qj->future = fut;
+
+	if (queue_job_enqueue(tq, qj, jattr) < 0) {
+		queue_future_free(fut);
+		return NULL;
+	}
+
+	return fut;
+}
+
+task_future_state_t task_future_poll(task_future_t *fut) {
+	return (task_future_state_t)__atomic_load_n(&fut->state, __ATOMIC_ACQUIRE);
+}
+
+task_future_state_t task_future_wait(task_future_t *fut, const int timeout_ms) {
+	struct timespec ts;
+	int state;
+
+	if ((state = __atomic_load_n(&fut->state, __ATOMIC_ACQUIRE)) != TASK_FUTURE_PENDING || !timeout_ms) {
+		return (task_future_state_t)state;
+	}
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec  += timeout_ms / 1000;
+		ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&(fut->mutex));
+	while (fut->state == TASK_FUTURE_PENDING) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&(fut->cond), &(fut->mutex));
+		} else if (pthread_cond_timedwait(&(fut->cond), &(fut->mutex), &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	state = fut->state;
+	pthread_mutex_unlock(&(fut->mutex));
+
+	return (task_future_state_t)state;
+}
+
+void * task_future_get_result(task_future_t *fut) {
+	if (__atomic_load_n(&fut->state, __ATOMIC_ACQUIRE) != TASK_FUTURE_DONE) {
+		return NULL;
+	}
+	return fut->result;
+}
+
+int task_future_then(task_future_t *fut, task_future_then_t then, void *arg) {
+	if (!fut || !then) {
+		return TASK_QUEUE_ERR;
+	}
+
+	pthread_mutex_lock(&(fut->mutex));
+	if (fut->then) {
+		pthread_mutex_unlock(&(fut->mutex));
+		return TASK_QUEUE_ERR;
+	}
+	if (fut->state == TASK_FUTURE_PENDING) {
+		fut->then 	= then;
+		fut->then_arg 	= arg;
+		pthread_mutex_unlock(&(fut->mutex));
+		return 0;
+	}
+	pthread_mutex_unlock(&(fut->mutex));
+
+	then(fut, arg);
+
+	return 0;
+}
+
+void task_future_release(task_future_t *fut) {
+	if (fut && !__atomic_sub_fetch(&fut->refs, 1, __ATOMIC_ACQ_REL)) {
+		queue_future_free(fut);
+	}
+}
+
+static int queue_job_enqueue(task_queue_t *tq, queue_job_t *qj, const task_job_attr_t *jattr) {
+	queue_strand_t *strand;
+	long key = jattr ? jattr->key : TASK_JOB_KEY_NONE;
+	int admit;
+
+	qj->prio = jattr ? jattr->prio : TASK_QUEUE_PRIO_NORMAL;
+	qj->hint = jattr ? jattr->hint : TASK_JOB_HINT_NONE;
+	qj->enqueue_ns = queue_now_ns();
+	qj->deadline_ns = jattr ? jattr->deadline_ns : 0;
+
+	/* a flow that can not be allocated leaves its jobs unscheduled */
+	if (jattr && jattr->flow != TASK_JOB_FLOW_NONE) {
+		qj->flow = queue_flow_get(tq, jattr->flow);
+	}
+
+	/* a key keeps its jobs on one worker as long as it is not stolen */
+	if (key != TASK_JOB_KEY_NONE && qj->hint == TASK_JOB_HINT_NONE) {
+		qj->hint = key & 0x7FFFFFFF;
+	}
+
+	/* accounted before the store so that workers never see it negative */
+	queue_hwm_update(&tq->size_hwm, __atomic_add_fetch(&tq->size, 1, __ATOMIC_SEQ_CST));
+
+	while (1) {
+		admit = 1;
+		if (key != TASK_JOB_KEY_NONE && !qj->strand) {
+			admit = queue_strand_admit(tq, qj, key);
+		}
+
+		if (admit < 0) {
+			break; // waits on the strand backlog
+		}
+
+		if (admit && queue_slot_reserve(tq)) {
+			if (queue_job_put(tq, qj)) {
+				break;
 			}
+			__atomic_sub_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST);
+		}
+
+		/* the queue is full */
+		if (tq->overflow == TASK_QUEUE_OVERFLOW_DROP_OLDEST && queue_job_shed(tq, qj->prio)) {
+			continue;
+		}
+
+		if (tq->overflow == TASK_QUEUE_OVERFLOW_BLOCK && queue_space_wait(tq)) {
+			continue;
+		}
+
+		__atomic_add_fetch(&tq->rejected, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&tq->size, 1, __ATOMIC_SEQ_CST);
+		strand = qj->strand;
+		queue_job_destroy(tq, qj);
+		if (strand) {
+			queue_strand_release(tq, strand);
 		}
+		return TASK_QUEUE_ERR_FULL;
 	}
 
-	ret = tq->active_tasks;	
-	pthread_mutex_unlock(&(tq->mutex));
+	if (__atomic_load_n(&tq->idle_workers, __ATOMIC_SEQ_CST) &&
+	    !__atomic_load_n(&tq->suspended, __ATOMIC_SEQ_CST)) {
+		queue_workers_wakeup(tq, 0);
+	}
 
-	return ret;
+	if (__atomic_load_n(&tq->batch_waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(tq->mutex));
+		pthread_cond_broadcast(&(tq->batch_cond));
+		pthread_mutex_unlock(&(tq->mutex));
+	}
+
+	return __atomic_load_n(&tq->active_tasks, __ATOMIC_RELAXED);
 }
 
 void task_queue_suspend(task_queue_t *tq) {
@@ -121,128 +742,1192 @@ void task_queue_suspend(task_queue_t *tq) {
 		return;
 	}
 
-	pthread_mutex_lock(&(tq->mutex));
-	tq->suspended = 1;
-	pthread_mutex_unlock(&(tq->mutex));
+	__atomic_store_n(&tq->suspended, 1, __ATOMIC_SEQ_CST);
 }
 
 void task_queue_unsuspend(task_queue_t *tq) {
-	pthread_t thread;
-	int i, can_run, need_run, run;
+	if (!tq) {
+		return;
+	}
+
+	__atomic_store_n(&tq->suspended, 0, __ATOMIC_SEQ_CST);
+	queue_workers_wakeup(tq, 1);
+}
+
+void task_queue_set_limit(task_queue_t *tq, const int limit) {
+	int value;
 
 	if (!tq) {
 		return;
 	}
 
+	value = limit < 1 ? 1 : (limit > tq->workers_num ? tq->workers_num : limit);
+
+	/* parked workers above the old limit start taking jobs, idle ones
+	 * above the new limit move to the limit wait */
 	pthread_mutex_lock(&(tq->mutex));
-	tq->suspended = 0;
-
-	if (tq->size && tq->active_tasks < max_active_tasks) {
-		can_run = max_active_tasks - tq->active_tasks;
-		need_run = tq->size - tq->active_tasks;
-		run = need_run < can_run ? need_run : can_run;		
-		
-		for (i = 0; i < run; i++) {
-			if (pthread_create(&thread, NULL, &queue_job_exec, tq) < 0) {
-				// perror("new thread creation error");
-			} else {
-				pthread_detach(thread);
-				tq->active_tasks++;
-			}
-		}
-	}
+	__atomic_store_n(&tq->limit, value, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&(tq->limit_cond));
+	pthread_cond_broadcast(&(tq->cond));
 	pthread_mutex_unlock(&(tq->mutex));
 }
 
+int task_queue_set_flow_weight(task_queue_t *tq, const long flow, const int weight) {
+	queue_flow_t *qf;
+
+	if (!tq || flow == TASK_JOB_FLOW_NONE || weight < 1 || !(qf = queue_flow_get(tq, flow))) {
+		return TASK_QUEUE_ERR;
+	}
+
+	__atomic_store_n(&qf->weight, weight, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int task_queue_get_limit(task_queue_t *tq) {
+	return __atomic_load_n(&tq->limit, __ATOMIC_RELAXED);
+}
+
 int task_queue_get_size(task_queue_t *tq) {
-	int res;
-	pthread_mutex_lock(&(tq->mutex));
-	res = tq->size;
-	pthread_mutex_unlock(&(tq->mutex));
-	return res;
+	return __atomic_load_n(&tq->size, __ATOMIC_SEQ_CST);
 }
 
 int task_queue_is_empty(task_queue_t *tq) {
 	return task_queue_get_size(tq) == 0;
 }
 
-static queue_job_t * queue_job_create(task_func_t func, void *arg) {
+void task_queue_get_stats(task_queue_t *tq, task_queue_stats_t *stats) {
+	if (!tq || !stats) {
+		return;
+	}
+
+	stats->size 		= __atomic_load_n(&tq->size, __ATOMIC_RELAXED);
+	stats->pending 		= __atomic_load_n(&tq->pending, __ATOMIC_RELAXED);
+	stats->active_tasks 	= __atomic_load_n(&tq->active_tasks, __ATOMIC_RELAXED);
+	stats->rejected 	= __atomic_load_n(&tq->rejected, __ATOMIC_RELAXED);
+	stats->dropped 		= __atomic_load_n(&tq->dropped, __ATOMIC_RELAXED);
+	stats->blocked 		= __atomic_load_n(&tq->blocked, __ATOMIC_RELAXED);
+	stats->delayed 		= __atomic_load_n(&tq->delayed, __ATOMIC_RELAXED);
+	stats->expired 		= __atomic_load_n(&tq->expired, __ATOMIC_RELAXED);
+}
+
+void task_queue_get_metrics(task_queue_t *tq, task_queue_metrics_t *metrics) {
+	int i, p;
+
+	if (!tq || !metrics) {
+		return;
+	}
+
+	memset(metrics, 0, sizeof(task_queue_metrics_t));
+
+	for (i = 0; i < tq->workers_num; i++) {
+		queue_hist_merge(&metrics->wait, &tq->workers[i].wait);
+		queue_hist_merge(&metrics->service, &tq->workers[i].service);
+	}
+	for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+		metrics->lane_pending_hwm[p] = __atomic_load_n(&tq->lanes[p].pending_hwm, __ATOMIC_RELAXED);
+	}
+	metrics->size_hwm		= __atomic_load_n(&tq->size_hwm, __ATOMIC_RELAXED);
+	metrics->pending_hwm		= __atomic_load_n(&tq->pending_hwm, __ATOMIC_RELAXED);
+	metrics->active_workers		= __atomic_load_n(&tq->active_tasks, __ATOMIC_RELAXED);
+	metrics->active_workers_hwm	= __atomic_load_n(&tq->active_hwm, __ATOMIC_RELAXED);
+	metrics->workers		= tq->workers_num;
+	metrics->limit			= __atomic_load_n(&tq->limit, __ATOMIC_RELAXED);
+}
+
+unsigned long long task_queue_now_ns(void) {
+	return queue_now_ns();
+}
+
+unsigned long long task_queue_hist_percentile(const task_queue_hist_t *hist, const double q) {
+	unsigned long long rank, seen = 0;
+	int i;
+
+	if (!hist || !hist->count) {
+		return 0;
+	}
+
+	rank = (unsigned long long)(q * hist->count + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	for (i = 0; i < TASK_QUEUE_HIST_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			return (1ULL << i) < hist->max_us ? (1ULL << i) : hist->max_us;
+		}
+	}
+
+	return hist->max_us;
+}
+
+static queue_job_t * queue_job_create(task_queue_t *tq, task_func_t func, task_batch_func_t batch_func, void *arg) {
 	queue_job_t *qj;
 
-	if (!func) {
+	if (!func && !batch_func) {
+		return NULL;
+	}
+
+	qj = (queue_job_t *)obj_pool_alloc(tq->job_pool);
+	if (!qj) {
 		return NULL;
 	}
-	
-	qj = (queue_job_t *)malloc(sizeof(queue_job_t));
 	qj->func 	= func;
+	qj->batch_func 	= batch_func;
 	qj->arg 	= arg;
+	qj->prio	= TASK_QUEUE_PRIO_NORMAL;
+	qj->hint	= TASK_JOB_HINT_NONE;
+	qj->token	= 0;
+	qj->deadline_ns	= 0;
+	qj->strand	= NULL;
+	qj->flow	= NULL;
+	qj->future	= NULL;
 	qj->next	= NULL;
 
 	return qj;
 }
 
-static void queue_job_destroy(queue_job_t *qj) {
+static void queue_job_destroy(task_queue_t *tq, queue_job_t *qj) {
 	if (!qj) {
 		return;
 	}
-	free(qj);
+	obj_pool_free(tq->job_pool, qj);
 }
 
-static queue_job_t * queue_job_get_next(task_queue_t *tq) {
-	queue_job_t *qj;
+static uint64_t queue_now_ns(void) {
+	struct timespec ts;
 
-	if (!tq) {
-		return NULL;
-	}
-	
-	pthread_mutex_lock(&(tq->mutex));
-	if (tq->next) {
-		qj = tq->next;
-		tq->next = qj->next;
-	} else {
-		qj = NULL;
-	}
-	pthread_mutex_unlock(&(tq->mutex));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return qj;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+/* single writer, stores are atomic so that snapshots never see torn values */
+static void queue_hist_add(task_queue_hist_t *hist, const uint64_t ns) {
+	unsigned long long us = ns / 1000;
+	int i = us ? 64 - __builtin_clzll(us) : 0;
 
-static void * queue_job_exec(void *arg_tq) {
-	task_queue_t *tq = (task_queue_t *)arg_tq;
-	queue_job_t *qj;
-	pthread_t thread;
-	int i, can_run, need_run, run;
+	if (i >= TASK_QUEUE_HIST_BUCKETS) {
+		i = TASK_QUEUE_HIST_BUCKETS - 1;
+	}
 
-	if (!tq) {
-		return NULL;
+	__atomic_store_n(&hist->buckets[i], hist->buckets[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum_us, hist->sum_us + us, __ATOMIC_RELAXED);
+	if (us > hist->max_us) {
+		__atomic_store_n(&hist->max_us, us, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+}
+
+static void queue_hist_merge(task_queue_hist_t *dst, const task_queue_hist_t *src) {
+	unsigned long long max_us = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < TASK_QUEUE_HIST_BUCKETS; i++) {
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
 	}
-	
-	qj = queue_job_get_next(tq);
-	
-	if (qj && qj->func) {
-		qj->func(qj->arg);
+	dst->count  += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum_us += __atomic_load_n(&src->sum_us, __ATOMIC_RELAXED);
+	if (max_us > dst->max_us) {
+		dst->max_us = max_us;
 	}
-	
-	queue_job_destroy(qj);
+}
+
+static void queue_hwm_update(int *hwm, const int value) {
+	int cur = __atomic_load_n(hwm, __ATOMIC_RELAXED);
+
+	while (value > cur &&
+	       !__atomic_compare_exchange_n(hwm, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* takes a pending slot unless max_size is reached, workers re-queueing
+ * follow-up jobs may exceed it when producers block, otherwise the pool
+ * could wait on itself */
+static int queue_slot_reserve(task_queue_t *tq) {
+	int pending = __atomic_load_n(&tq->pending, __ATOMIC_SEQ_CST);
+
+	do {
+		if (queue_is_full(tq, pending)) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&tq->pending, &pending, pending + 1, 1,
+					      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	queue_hwm_update(&tq->pending_hwm, pending + 1);
+
+	return 1;
+}
+
+/* pending and deferred jobs count against max_size */
+static int queue_is_full(task_queue_t *tq, const int pending) {
+	return tq->max_size &&
+	       pending + __atomic_load_n(&tq->deferred, __ATOMIC_SEQ_CST) >= tq->max_size &&
+	       !(tq->overflow == TASK_QUEUE_OVERFLOW_BLOCK && current_worker && current_worker->tq == tq);
+}
+
+/* returns 0 once the queue is shutting down */
+static int queue_space_wait(task_queue_t *tq) {
+	struct timespec ts;
+	int pending;
 
 	pthread_mutex_lock(&(tq->mutex));
-	tq->active_tasks--;
-	tq->size--;
-	if (tq->size && tq->active_tasks < max_active_tasks && !tq->suspended) {
-		can_run = max_active_tasks - tq->active_tasks;
-		need_run = tq->size - tq->active_tasks;
-		run = need_run < can_run ? need_run : can_run;		
-		
-		for (i = 0; i < run; i++) {
-			if (pthread_create(&thread, NULL, &queue_job_exec, tq) < 0) {
-				// perror("new thread creation error");
+	__atomic_add_fetch(&tq->blocked_producers, 1, __ATOMIC_SEQ_CST);
+	pending = __atomic_load_n(&tq->pending, __ATOMIC_SEQ_CST);
+
+	/* a full ring has no limit to compare with, the wait is bounded */
+	if (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST) && (!tq->max_size || queue_is_full(tq, pending))) {
+		__atomic_add_fetch(&tq->blocked, 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TASK_QUEUE_BLOCK_WAIT_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&(tq->space_cond), &(tq->mutex), &ts);
+	}
+
+	__atomic_sub_fetch(&tq->blocked_producers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(tq->mutex));
+
+	return !__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST);
+}
+
+/* drops the oldest job of the lowest non-empty lane down to prio (see
+ * queue_lane_pop for the steal backend), returns 0 if there is nothing
+ * to drop */
+static int queue_job_shed(task_queue_t *tq, const int prio) {
+	queue_job_t *qj;
+	int p;
+
+	for (p = TASK_QUEUE_PRIO_NUM - 1; p >= prio; p--) {
+		if (__atomic_load_n(&tq->lanes[p].pending, __ATOMIC_SEQ_CST) <= 0) {
+			continue;
+		}
+
+		/* a flow token sheds from the flow with the most jobs */
+		if ((qj = queue_lane_pop(tq, NULL, p)) && qj->token) {
+			queue_job_destroy(tq, qj);
+			qj = queue_flow_take(tq, p, 1);
+		}
+
+		if (qj) {
+			__atomic_sub_fetch(&tq->lanes[p].pending, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST);
+			queue_job_drop(tq, qj);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* hands a job taken from the store to drop_func, the next job of its
+ * strand takes its place */
+static void queue_job_drop(task_queue_t *tq, queue_job_t *qj) {
+	queue_strand_t *strand = qj->strand;
+
+	queue_job_discard(tq, qj);
+
+	if (strand) {
+		queue_strand_release(tq, strand);
+	}
+}
+
+static void queue_job_discard(task_queue_t *tq, queue_job_t *qj) {
+	__atomic_add_fetch(&tq->dropped, 1, __ATOMIC_RELAXED);
+
+	if (qj->future) {
+		queue_future_complete(qj->future, TASK_FUTURE_DROPPED, NULL);
+	} else if (tq->drop_func) {
+		tq->drop_func(qj->func, qj->arg);	// func is NULL for batchable jobs
+	}
+	queue_job_destroy(tq, qj);
+
+	__atomic_sub_fetch(&tq->size, 1, __ATOMIC_SEQ_CST);
+}
+
+/* the job was taken past its deadline, it is handed to drop_func without
+ * running and the next job of its strand takes its place */
+static void queue_job_expire(task_queue_t *tq, queue_job_t *qj) {
+	queue_strand_t *strand = qj->strand;
+
+	__atomic_add_fetch(&tq->expired, 1, __ATOMIC_RELAXED);
+
+	if (qj->future) {
+		queue_future_complete(qj->future, TASK_FUTURE_DROPPED, NULL);
+	} else if (tq->drop_func) {
+		tq->drop_func(qj->func, qj->arg);
+	}
+	queue_job_destroy(tq, qj);
+
+	__atomic_sub_fetch(&tq->size, 1, __ATOMIC_SEQ_CST);
+
+	if (strand) {
+		queue_strand_release(tq, strand);
+	}
+}
+
+/* Returns 1 if qj is the head of its strand and goes to the store,
+ * -1 if it was queued on the backlog of a busy strand, 0 if the queue
+ * is full or the strand could not be allocated.
+ */
+static int queue_strand_admit(task_queue_t *tq, queue_job_t *qj, const long key) {
+	queue_strand_bucket_t *bucket = &tq->strand_buckets[(unsigned long)key % TASK_QUEUE_STRAND_BUCKETS];
+	queue_strand_t *strand;
+	int ret = 0;
+
+	pthread_mutex_lock(&(bucket->mutex));
+	for (strand = bucket->strands; strand && strand->key != key; strand = strand->bucket_next);
+
+	if (strand) {
+		if (!queue_is_full(tq, __atomic_load_n(&tq->pending, __ATOMIC_SEQ_CST))) {
+			if (!strand->next) {
+				strand->next = qj;
 			} else {
-				pthread_detach(thread);
-				tq->active_tasks++;
+				strand->last->next = qj;
+			}
+			strand->last = qj;
+			qj->strand = strand;
+			__atomic_add_fetch(&tq->deferred, 1, __ATOMIC_SEQ_CST);
+			ret = -1;
+		}
+	} else if ((strand = (queue_strand_t *)obj_pool_alloc(tq->strand_pool))) {
+		strand->key 		= key;
+		strand->next		= NULL;
+		strand->last		= NULL;
+		strand->bucket_next	= bucket->strands;
+		bucket->strands		= strand;
+		qj->strand 		= strand;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&(bucket->mutex));
+
+	return ret;
+}
+
+/* The job holding the strand has left the store. The next one of the
+ * backlog is put in its place, it has already been admitted so max_size
+ * does not apply. A store with no room sheds it. The strand is freed
+ * once its backlog is empty.
+ */
+static void queue_strand_release(task_queue_t *tq, queue_strand_t *strand) {
+	queue_strand_bucket_t *bucket = &tq->strand_buckets[(unsigned long)strand->key % TASK_QUEUE_STRAND_BUCKETS];
+	queue_strand_t **link;
+	queue_job_t *qj;
+
+	while (1) {
+		pthread_mutex_lock(&(bucket->mutex));
+		if ((qj = strand->next)) {
+			if (!(strand->next = qj->next)) {
+				strand->last = NULL;
+			}
+			qj->next = NULL;
+		} else {
+			for (link = &bucket->strands; *link != strand; link = &(*link)->bucket_next);
+			*link = strand->bucket_next;
+		}
+		pthread_mutex_unlock(&(bucket->mutex));
+
+		if (!qj) {
+			obj_pool_free(tq->strand_pool, strand);
+			return;
+		}
+
+		queue_hwm_update(&tq->pending_hwm, __atomic_add_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST));
+		__atomic_sub_fetch(&tq->deferred, 1, __ATOMIC_SEQ_CST);
+
+		if (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST) && queue_job_put(tq, qj)) {
+			return;
+		}
+
+		__atomic_sub_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST);
+		queue_job_discard(tq, qj);
+	}
+}
+
+/* called with timers_mutex locked, no wheel is started once destroy began */
+static int queue_timers_start(task_queue_t *tq) {
+	if (tq->timers_closed) {
+		return 0;
+	}
+
+	if (!tq->delayed_pool) {
+		tq->delayed_pool = obj_pool_create(sizeof(queue_delayed_t), 0);
+	}
+	if (tq->delayed_pool && !tq->timers) {
+		tq->timers = timer_wheel_create(tq->timer_tick_ms);
+	}
+
+	return tq->timers != NULL;
+}
+
+/* wheel thread, the job goes through the overflow policy like any other */
+static void queue_delayed_fire(void *arg) {
+	queue_delayed_t *qd = (queue_delayed_t *)arg;
+	task_queue_t *tq = qd->tq;
+	int ret;
+
+	__atomic_sub_fetch(&tq->delayed, 1, __ATOMIC_RELAXED);
+
+	if ((ret = task_queue_enqueue_attr(tq, qd->func, qd->arg, &qd->jattr)) < 0) {
+		/* accepted when delayed, so dropped rather than rejected */
+		if (ret == TASK_QUEUE_ERR_FULL) {
+			__atomic_sub_fetch(&tq->rejected, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&tq->dropped, 1, __ATOMIC_RELAXED);
+		if (tq->drop_func) {
+			tq->drop_func(qd->func, qd->arg);
+		}
+	}
+
+	obj_pool_free(tq->delayed_pool, qd);
+}
+
+static void queue_delayed_discard(void *arg) {
+	queue_delayed_t *qd = (queue_delayed_t *)arg;
+	task_queue_t *tq = qd->tq;
+
+	__atomic_sub_fetch(&tq->delayed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tq->dropped, 1, __ATOMIC_RELAXED);
+
+	if (tq->drop_func) {
+		tq->drop_func(qd->func, qd->arg);
+	}
+
+	obj_pool_free(tq->delayed_pool, qd);
+}
+
+static task_future_t * queue_future_create(task_future_func_t func, void *arg) {
+	task_future_t *fut;
+	pthread_condattr_t cattr;
+
+	fut = (task_future_t *)calloc(1, sizeof(task_future_t));
+	if (!fut) {
+		return NULL;
+	}
+
+	fut->state 	= TASK_FUTURE_PENDING;
+	fut->refs 	= 2;
+	fut->func 	= func;
+	fut->arg 	= arg;
+
+	pthread_mutex_init(&(fut->mutex), NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(fut->cond), &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	return fut;
+}
+
+static void queue_future_free(task_future_t *fut) {
+	pthread_cond_destroy(&(fut->cond));
+	pthread_mutex_destroy(&(fut->mutex));
+	free(fut);
+}
+
+static void queue_future_run(void *arg) {
+	task_future_t *fut = (task_future_t *)arg;
+
+	queue_future_complete(fut, TASK_FUTURE_DONE, fut->func(fut->arg));
+}
+
+/* wakes the waiters and runs the continuation, then drops the reference
+ * of the queue */
+static void queue_future_complete(task_future_t *fut, const int state, void *result) {
+	task_future_then_t then;
+
+	pthread_mutex_lock(&(fut->mutex));
+	fut->result = result;
+	__atomic_store_n(&fut->state, state, __ATOMIC_RELEASE);
+	then = fut->then;
+	pthread_cond_broadcast(&(fut->cond));
+	pthread_mutex_unlock(&(fut->mutex));
+
+	if (then) {
+		then(fut, fut->then_arg);
+	}
+
+	task_future_release(fut);
+}
+
+/* returns 0 if the backing store is full */
+static int queue_job_put(task_queue_t *tq, queue_job_t *qj) {
+	queue_lane_t *lane = &tq->lanes[qj->prio];
+	queue_flow_lane_t *fl;
+	queue_job_t *token;
+	int ret;
+
+	if (!qj->flow) {
+		return queue_store_put(tq, qj);
+	}
+
+	if (!(token = (queue_job_t *)obj_pool_alloc(tq->job_pool))) {
+		return 0;
+	}
+	*token 		= *qj;
+	token->token 	= 1;
+	token->strand 	= NULL;
+	token->flow 	= NULL;
+	token->future 	= NULL;
+	token->next 	= NULL;
+
+	/* a worker taking the token waits here for the job to be in its flow */
+	pthread_mutex_lock(&(lane->fair_mutex));
+	if ((ret = queue_store_put(tq, token))) {
+		fl = &qj->flow->lanes[qj->prio];
+		qj->next = NULL;
+		if (!fl->next) {
+			fl->next = qj;
+		} else {
+			fl->last->next = qj;
+		}
+		fl->last = qj;
+
+		if (!fl->jobs++) {
+			fl->deficit 	= 0;
+			fl->active_next = NULL;
+			if (!lane->flows) {
+				lane->flows = qj->flow;
+			} else {
+				lane->flows_last->lanes[qj->prio].active_next = qj->flow;
+			}
+			lane->flows_last = qj->flow;
+		}
+	}
+	pthread_mutex_unlock(&(lane->fair_mutex));
+
+	if (!ret) {
+		queue_job_destroy(tq, token);
+	}
+
+	return ret;
+}
+
+static queue_flow_t * queue_flow_get(task_queue_t *tq, const long id) {
+	queue_flow_bucket_t *bucket = &tq->flow_buckets[(unsigned long)id % TASK_QUEUE_FLOW_BUCKETS];
+	queue_flow_t *qf;
+	int p;
+
+	pthread_mutex_lock(&(bucket->mutex));
+	for (qf = bucket->flows; qf && qf->id != id; qf = qf->bucket_next);
+
+	if (!qf && (qf = (queue_flow_t *)obj_pool_alloc(tq->flow_pool))) {
+		qf->id 		= id;
+		qf->weight 	= 1;
+		for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+			qf->lanes[p].next 	 = NULL;
+			qf->lanes[p].last 	 = NULL;
+			qf->lanes[p].jobs 	 = 0;
+			qf->lanes[p].deficit 	 = 0;
+			qf->lanes[p].active_next = NULL;
+		}
+		qf->bucket_next = bucket->flows;
+		bucket->flows 	= qf;
+	}
+	pthread_mutex_unlock(&(bucket->mutex));
+
+	return qf;
+}
+
+/* Takes the job a token was taken for. The flow at the head of the lane
+ * gets its weight in jobs for the round and then goes to the tail, with
+ * longest the job comes instead from the flow with the most jobs.
+ */
+static queue_job_t * queue_flow_take(task_queue_t *tq, const int prio, const int longest) {
+	queue_lane_t *lane = &tq->lanes[prio];
+	queue_flow_t *qf, *prev = NULL, *it, *it_prev = NULL;
+	queue_flow_lane_t *fl;
+	queue_job_t *qj = NULL;
+
+	pthread_mutex_lock(&(lane->fair_mutex));
+	qf = lane->flows;
+	for (it = qf; longest && it; it_prev = it, it = it->lanes[prio].active_next) {
+		if (it->lanes[prio].jobs > qf->lanes[prio].jobs) {
+			qf   = it;
+			prev = it_prev;
+		}
+	}
+
+	if (qf) {
+		fl = &qf->lanes[prio];
+		if (!longest && !fl->deficit) {
+			fl->deficit = __atomic_load_n(&qf->weight, __ATOMIC_RELAXED);
+		}
+
+		qj = fl->next;
+		if (!(fl->next = qj->next)) {
+			fl->last = NULL;
+		}
+		qj->next = NULL;
+		fl->jobs--;
+		if (!longest) {
+			fl->deficit--;
+		}
+
+		/* unlinked when empty, rotated once its round is over */
+		if (!fl->jobs || (!longest && !fl->deficit)) {
+			if (prev) {
+				prev->lanes[prio].active_next = fl->active_next;
+			} else {
+				lane->flows = fl->active_next;
+			}
+			if (lane->flows_last == qf) {
+				lane->flows_last = prev;
+			}
+			fl->active_next = NULL;
+
+			if (fl->jobs) {
+				if (!lane->flows) {
+					lane->flows = qf;
+				} else {
+					lane->flows_last->lanes[prio].active_next = qf;
+				}
+				lane->flows_last = qf;
+			} else {
+				fl->deficit = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&(lane->fair_mutex));
+
+	return qj;
+}
+
+/* returns 0 if the backing store is full */
+static int queue_store_put(task_queue_t *tq, queue_job_t *qj) {
+	queue_worker_t *qw;
+	queue_lane_t *lane;
+	int hint = qj->hint;
+	int prio = qj->prio;
+	int limit = __atomic_load_n(&tq->limit, __ATOMIC_RELAXED);
+	int ret = 1;
+
+	lane = &tq->lanes[prio];
+	queue_hwm_update(&lane->pending_hwm, __atomic_add_fetch(&lane->pending, 1, __ATOMIC_SEQ_CST));
+
+	if (tq->backend == TASK_QUEUE_BACKEND_RING) {
+		ret = mpmc_ring_push(lane->ring, qj);
+	} else if (tq->backend == TASK_QUEUE_BACKEND_STEAL) {
+		if (hint == TASK_JOB_HINT_NONE && current_worker && current_worker->tq == tq) {
+			/* jobs spawned by a worker stay on its core */
+			qw = current_worker;
+		} else if (hint == TASK_JOB_HINT_NONE) {
+			qw = &tq->workers[__atomic_fetch_add(&tq->rr_next, 1, __ATOMIC_RELAXED) % limit];
+		} else {
+			qw = &tq->workers[(unsigned int)hint % limit];
+		}
+
+		if (qw == current_worker) {
+			ret = ws_deque_push(qw->lanes[prio].deque, qj);
+		} else {
+			queue_inbox_put(&qw->lanes[prio], qj);
+		}
+	} else {
+		pthread_mutex_lock(&(lane->list_mutex));
+		if (!lane->next) {
+			lane->next = qj;
+			lane->last = qj;
+		} else {
+			lane->last->next 	= qj; // assign next
+			lane->last 		= qj; // move pointer
+		}
+		pthread_mutex_unlock(&(lane->list_mutex));
+	}
+
+	if (!ret) {
+		__atomic_sub_fetch(&lane->pending, 1, __ATOMIC_SEQ_CST);
+	}
+
+	return ret;
+}
+
+static queue_job_t * queue_job_get_next(task_queue_t *tq, queue_worker_t *qw) {
+	queue_job_t *qj;
+	int order[TASK_QUEUE_PRIO_NUM];
+	int i, n;
+
+	n = queue_lanes_order(tq, qw, order);
+
+	for (i = 0; i < n; i++) {
+		if ((qj = queue_lane_take(tq, qw, order[i]))) {
+			__atomic_sub_fetch(&tq->lanes[order[i]].pending, 1, __ATOMIC_SEQ_CST);
+			return qj;
+		}
+	}
+
+	return NULL;
+}
+
+/* Fills order with the non-empty lanes in the sequence they should be
+ * tried. Strict scheduling follows priorities, weighted scheduling puts
+ * first the lane elected by a smooth weighted round robin kept per worker,
+ * so every lane gets its share of each worker.
+ */
+static int queue_lanes_order(task_queue_t *tq, queue_worker_t *qw, int *order) {
+	int p, n = 0, best = -1, total = 0;
+
+	for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+		if (__atomic_load_n(&tq->lanes[p].pending, __ATOMIC_SEQ_CST) > 0) {
+			order[n++] = p;
+		}
+	}
+
+	if (tq->sched != TASK_QUEUE_SCHED_WEIGHTED || n < 2) {
+		return n;
+	}
+
+	for (p = 0; p < n; p++) {
+		qw->credit[order[p]] += tq->lanes[order[p]].weight;
+		total += tq->lanes[order[p]].weight;
+		if (best < 0 || qw->credit[order[p]] > qw->credit[order[best]]) {
+			best = p;
+		}
+	}
+	qw->credit[order[best]] -= total;
+
+	for (p = best; p > 0; p--) {
+		total = order[p];
+		order[p] = order[p - 1];
+		order[p - 1] = total;
+	}
+
+	return n;
+}
+
+/* takes the next job of a lane, a flow token is swapped for the job of
+ * the flow whose turn it is */
+static queue_job_t * queue_lane_take(task_queue_t *tq, queue_worker_t *qw, const int prio) {
+	queue_job_t *qj = queue_lane_pop(tq, qw, prio);
+
+	if (qj && qj->token) {
+		queue_job_destroy(tq, qj);
+		qj = queue_flow_take(tq, prio, 0);
+	}
+
+	return qj;
+}
+
+static queue_job_t * queue_lane_pop(task_queue_t *tq, queue_worker_t *qw, const int prio) {
+	queue_lane_t *lane = &tq->lanes[prio];
+	queue_worker_lane_t *wl;
+	queue_job_t *qj = NULL, *tmp;
+
+	if (tq->backend == TASK_QUEUE_BACKEND_RING) {
+		if (!mpmc_ring_pop(lane->ring, (void **)&qj)) {
+			qj = NULL;
+		}
+		return qj;
+	}
+
+	if (tq->backend == TASK_QUEUE_BACKEND_STEAL) {
+		if (!qw) {
+			/* shedding, the deques are stolen from newest first */
+			if ((qj = queue_inbox_take_oldest(tq, prio))) {
+				return qj;
 			}
+			return queue_job_steal(tq, NULL, prio);
+		}
+
+		wl = &qw->lanes[prio];
+
+		if (ws_deque_pop(wl->deque, (void **)&qj) == WS_DEQUE_OK) {
+			return qj;
+		}
+
+		/* the oldest inbox job is run right away, the rest is pushed
+		 * newest first so that the owner pops in arrival order and
+		 * thieves take the most recent ones */
+		pthread_mutex_lock(&(wl->inbox_mutex));
+		qj = wl->inbox_next;
+		wl->inbox_next = NULL;
+		wl->inbox_last = NULL;
+		pthread_mutex_unlock(&(wl->inbox_mutex));
+
+		if (qj) {
+			queue_job_t *rev = NULL;
+
+			while (qj->next) {
+				tmp = qj->next;
+				qj->next = rev;
+				rev = qj;
+				qj = tmp;
+			}
+			/* qj is the newest, rev runs from the newest but one to the oldest */
+			tmp = qj;
+			tmp->next = rev;
+			while (tmp->next) {
+				rev = tmp->next;
+				if (!ws_deque_push(wl->deque, tmp)) {
+					/* out of memory, hand it back to the inbox */
+					tmp->next = NULL;
+					queue_inbox_put(wl, tmp);
+				}
+				tmp = rev;
+			}
+
+			return tmp;
+		}
+
+		return queue_job_steal(tq, qw, prio);
+	}
+
+	pthread_mutex_lock(&(lane->list_mutex));
+	if (lane->next) {
+		qj = lane->next;
+		lane->next = qj->next;
+		if (!lane->next) {
+			lane->last = NULL;
+		}
+	}
+	pthread_mutex_unlock(&(lane->list_mutex));
+
+	return qj;
+}
+
+/* qw is NULL when the thief is not a worker */
+static queue_job_t * queue_job_steal(task_queue_t *tq, queue_worker_t *qw, const int prio) {
+	queue_job_t *qj;
+	queue_worker_t *victim;
+	int i, ret;
+	int first = qw ? 1 : 0, base = qw ? qw->id : 0;
+
+	for (i = first; i < tq->workers_num; i++) {
+		victim = &tq->workers[(base + i) % tq->workers_num];
+		do {
+			ret = ws_deque_steal(victim->lanes[prio].deque, (void **)&qj);
+		} while (ret == WS_DEQUE_ABORT);
+
+		if (ret == WS_DEQUE_OK) {
+			return qj;
 		}
 	}
+
+	/* busy owners may not have drained their inboxes yet */
+	for (i = first; i < tq->workers_num; i++) {
+		victim = &tq->workers[(base + i) % tq->workers_num];
+		if ((qj = queue_inbox_take(&victim->lanes[prio]))) {
+			return qj;
+		}
+	}
+
+	return NULL;
+}
+
+static void queue_inbox_put(queue_worker_lane_t *wl, queue_job_t *qj) {
+	pthread_mutex_lock(&(wl->inbox_mutex));
+	if (!wl->inbox_next) {
+		wl->inbox_next = qj;
+		wl->inbox_last = qj;
+	} else {
+		wl->inbox_last->next 	= qj;
+		wl->inbox_last 		= qj;
+	}
+	pthread_mutex_unlock(&(wl->inbox_mutex));
+}
+
+static queue_job_t * queue_inbox_take(queue_worker_lane_t *wl) {
+	queue_job_t *qj;
+
+	pthread_mutex_lock(&(wl->inbox_mutex));
+	qj = wl->inbox_next;
+	if (qj) {
+		wl->inbox_next = qj->next;
+		if (!wl->inbox_next) {
+			wl->inbox_last = NULL;
+		}
+		qj->next = NULL;
+	}
+	pthread_mutex_unlock(&(wl->inbox_mutex));
+
+	return qj;
+}
+
+/* the oldest of the jobs not yet moved to a deque, owners move their
+ * whole inbox at once so the heads compared are the oldest of each */
+static queue_job_t * queue_inbox_take_oldest(task_queue_t *tq, const int prio) {
+	queue_worker_lane_t *wl;
+	uint64_t oldest = 0;
+	int i, victim = -1;
+
+	for (i = 0; i < tq->workers_num; i++) {
+		wl = &tq->workers[i].lanes[prio];
+		pthread_mutex_lock(&(wl->inbox_mutex));
+		if (wl->inbox_next && (victim < 0 || wl->inbox_next->enqueue_ns < oldest)) {
+			oldest = wl->inbox_next->enqueue_ns;
+			victim = i;
+		}
+		pthread_mutex_unlock(&(wl->inbox_mutex));
+	}
+
+	if (victim < 0) {
+		return NULL;
+	}
+
+	/* the owner may have drained it meanwhile */
+	return queue_inbox_take(&tq->workers[victim].lanes[prio]);
+}
+
+/* runs and destroys a job taken from the store,
+ * returns the number of jobs completed */
+static int queue_job_run(task_queue_t *tq, queue_worker_t *qw, queue_job_t *qj) {
+	if (qj->batch_func) {
+		return queue_job_run_batch(tq, qw, qj);
+	}
+
+	queue_strand_t *strand = qj->strand;
+	uint64_t start = queue_now_ns();
+
+	qj->func(qj->arg);
+	queue_job_destroy(tq, qj);
+
+	queue_hist_add(&qw->service, queue_now_ns() - start);
+
+	if (strand) {
+		queue_strand_release(tq, strand);
+	}
+
+	return 1;
+}
+
+/* Fills a batch with the jobs of the same batch function waiting in the
+ * lane of qj, for up to batch_wait_us since qj was taken. A job of another
+ * kind met on the way ends the batch and is run right after it.
+ */
+static int queue_job_run_batch(task_queue_t *tq, queue_worker_t *qw, queue_job_t *qj) {
+	task_batch_func_t batch_func = qj->batch_func;
+	queue_job_t *next, *carry = NULL;
+	struct timespec deadline;
+	uint64_t start, now;
+	int i, count = 0, prio = qj->prio;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += tq->batch_wait_us / 1000000;
+	deadline.tv_nsec += (tq->batch_wait_us % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	qw->batch_strands[count] = qj->strand;
+	qw->batch[count++] = qj->arg;
+	queue_job_destroy(tq, qj);
+
+	while (count < tq->batch_max) {
+		next = NULL;
+		if (__atomic_load_n(&tq->lanes[prio].pending, __ATOMIC_SEQ_CST) > 0 &&
+		    (next = queue_lane_take(tq, qw, prio))) {
+			__atomic_sub_fetch(&tq->lanes[prio].pending, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST);
+			queue_space_notify(tq);
+		}
+
+		if (next) {
+			now = queue_now_ns();
+			queue_hist_add(&qw->wait, now - next->enqueue_ns);
+			if (next->deadline_ns && now > next->deadline_ns) {
+				queue_job_expire(tq, next);
+				continue;
+			}
+			if (next->batch_func != batch_func) {
+				carry = next;
+				break;
+			}
+			qw->batch_strands[count] = next->strand;
+			qw->batch[count++] = next->arg;
+			queue_job_destroy(tq, next);
+		} else if (!queue_batch_wait(tq, prio, &deadline)) {
+			break;
+		}
+	}
+
+	start = queue_now_ns();
+	batch_func(qw->batch, count);
+	queue_hist_add(&qw->service, queue_now_ns() - start);
+
+	/* a strand has a single job in the store, the batch holds distinct ones */
+	for (i = 0; i < count; i++) {
+		if (qw->batch_strands[i]) {
+			queue_strand_release(tq, qw->batch_strands[i]);
+		}
+	}
+
+	if (carry) {
+		count += queue_job_run(tq, qw, carry);
+	}
+
+	return count;
+}
+
+/* returns 0 once the deadline has passed or the queue is shutting down */
+static int queue_batch_wait(task_queue_t *tq, const int prio, const struct timespec *deadline) {
+	int ret = 1;
+
+	pthread_mutex_lock(&(tq->mutex));
+	__atomic_add_fetch(&tq->batch_waiters, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST) &&
+	    __atomic_load_n(&tq->lanes[prio].pending, __ATOMIC_SEQ_CST) <= 0) {
+		ret = pthread_cond_timedwait(&(tq->batch_cond), &(tq->mutex), deadline) != ETIMEDOUT;
+	}
+	__atomic_sub_fetch(&tq->batch_waiters, 1, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&(tq->mutex));
+
+	return ret && !__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST);
+}
+
+/* wakes a producer blocked on a full queue */
+static void queue_space_notify(task_queue_t *tq) {
+	if (__atomic_load_n(&tq->blocked_producers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(tq->mutex));
+		pthread_cond_signal(&(tq->space_cond));
+		pthread_mutex_unlock(&(tq->mutex));
+	}
+}
+
+static void queue_workers_wakeup(task_queue_t *tq, int all) {
+	pthread_mutex_lock(&(tq->mutex));
+	if (all) {
+		pthread_cond_broadcast(&(tq->cond));
+	} else {
+		pthread_cond_signal(&(tq->cond));
+	}
+	pthread_mutex_unlock(&(tq->mutex));
+}
+
+/* joins the first workers_num threads and frees the queue */
+static void queue_workers_release(task_queue_t *tq, int workers_num) {
+	int i, p;
+
+	for (i = 0; i < workers_num; i++) {
+		pthread_join(tq->workers[i].thread, NULL);
+	}
+
+	for (p = 0; p < TASK_QUEUE_PRIO_NUM; p++) {
+		for (i = 0; i < tq->workers_num; i++) {
+			if (!p) {
+				free(tq->workers[i].batch);
+				free(tq->workers[i].batch_strands);
+			}
+			ws_deque_destroy(tq->workers[i].lanes[p].deque);
+			pthread_mutex_destroy(&(tq->workers[i].lanes[p].inbox_mutex));
+		}
+		mpmc_ring_destroy(tq->lanes[p].ring);
+		pthread_mutex_destroy(&(tq->lanes[p].list_mutex));
+		pthread_mutex_destroy(&(tq->lanes[p].fair_mutex));
+	}
+
+	for (i = 0; i < TASK_QUEUE_FLOW_BUCKETS; i++) {
+		pthread_mutex_destroy(&(tq->flow_buckets[i].mutex));
+	}
+	obj_pool_destroy(tq->flow_pool);
+
+	for (i = 0; i < TASK_QUEUE_STRAND_BUCKETS; i++) {
+		pthread_mutex_destroy(&(tq->strand_buckets[i].mutex));
+	}
+	obj_pool_destroy(tq->strand_pool);
+	obj_pool_destroy(tq->job_pool);
+
+	pthread_cond_destroy(&(tq->batch_cond));
+	pthread_cond_destroy(&(tq->space_cond));
+	pthread_cond_destroy(&(tq->limit_cond));
+	pthread_cond_destroy(&(tq->cond));
+	pthread_mutex_destroy(&(tq->mutex));
+	pthread_mutex_destroy(&(tq->timers_mutex));
+
+	free(tq->workers);
+	free(tq);
+}
+
+
+/* Parks a worker above the limit. Its own jobs are handed to the inboxes
+ * of the workers left, they would otherwise only run once stolen.
+ */
+static void queue_worker_retire(task_queue_t *tq, queue_worker_t *qw) {
+	queue_job_t *qj;
+	int p, limit;
+
+	for (p = 0; tq->backend == TASK_QUEUE_BACKEND_STEAL && p < TASK_QUEUE_PRIO_NUM; p++) {
+		while (ws_deque_pop(qw->lanes[p].deque, (void **)&qj) == WS_DEQUE_OK ||
+		       (qj = queue_inbox_take(&qw->lanes[p]))) {
+			limit = __atomic_load_n(&tq->limit, __ATOMIC_SEQ_CST);
+			if (qw->id < limit) {
+				/* raised meanwhile, the job is still ours */
+				queue_inbox_put(&qw->lanes[p], qj);
+				return;
+			}
+			qj->next = NULL;
+			queue_inbox_put(&tq->workers[__atomic_fetch_add(&tq->rr_next, 1, __ATOMIC_RELAXED) % limit].lanes[p], qj);
+		}
+	}
+
+	pthread_mutex_lock(&(tq->mutex));
+	while (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST) &&
+	       qw->id >= __atomic_load_n(&tq->limit, __ATOMIC_SEQ_CST)) {
+		pthread_cond_wait(&(tq->limit_cond), &(tq->mutex));
+	}
+	pthread_mutex_unlock(&(tq->mutex));
+}
+
+/* Workers take jobs without touching tq->mutex while there is work
+ * to do, the mutex only guards parking on the condition variable.
+ * idle_workers and pending are checked in the opposite order by
+ * producers and workers, so a wakeup can not be lost.
+ */
+static void * queue_worker(void *arg_qw) {
+	queue_worker_t *qw = (queue_worker_t *)arg_qw;
+	task_queue_t *tq = qw->tq;
+	queue_job_t *qj;
+	uint64_t now;
+	int done;
+
+	current_worker = qw;
+
+	while (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST)) {
+		if (qw->id >= __atomic_load_n(&tq->limit, __ATOMIC_SEQ_CST)) {
+			queue_worker_retire(tq, qw);
+			continue;
+		}
+
+		qj = NULL;
+		if (!__atomic_load_n(&tq->suspended, __ATOMIC_SEQ_CST)) {
+			qj = queue_job_get_next(tq, qw);
+		}
+
+		if (!qj) {
+			pthread_mutex_lock(&(tq->mutex));
+			__atomic_add_fetch(&tq->idle_workers, 1, __ATOMIC_SEQ_CST);
+			while (!__atomic_load_n(&tq->shutdown, __ATOMIC_SEQ_CST) &&
+			       qw->id < __atomic_load_n(&tq->limit, __ATOMIC_SEQ_CST) &&
+			       (__atomic_load_n(&tq->suspended, __ATOMIC_SEQ_CST) ||
+				!__atomic_load_n(&tq->pending, __ATOMIC_SEQ_CST))) {
+				pthread_cond_wait(&(tq->cond), &(tq->mutex));
+			}
+			__atomic_sub_fetch(&tq->idle_workers, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&(tq->mutex));
+			continue;
+		}
+
+		__atomic_sub_fetch(&tq->pending, 1, __ATOMIC_SEQ_CST);
+		queue_space_notify(tq);
+		now = queue_now_ns();
+		queue_hist_add(&qw->wait, now - qj->enqueue_ns);
+
+		/* nobody waits for its result any more */
+		if (qj->deadline_ns && now > qj->deadline_ns) {
+			queue_job_expire(tq, qj);
+			continue;
+		}
+
+		queue_hwm_update(&tq->active_hwm, __atomic_add_fetch(&tq->active_tasks, 1, __ATOMIC_RELAXED));
+
+		done = queue_job_run(tq, qw, qj);
+
+		__atomic_sub_fetch(&tq->active_tasks, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&tq->size, done, __ATOMIC_SEQ_CST);
+	}
+
+	current_worker = NULL;
+
 	return NULL;
 }
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	4
+
+struct timer_wheel {
+	timer_entry_t	*slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+	uint64_t	base;		// next tick to expire
+	uint64_t	start_ns;	// tick 0
+	uint64_t	tick_ns;
+	timer_entry_t	*firing;	// slot of expired entries until their callback runs
+	int		size;
+	int		shutdown;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t	cond;		// signalled on the first armed entry and destroy
+	pthread_t	thread;
+};
+
+static uint64_t timer_now_ns(void);
+static uint64_t timer_now_tick(const timer_wheel_t *tw);
+static void timer_place(timer_wheel_t *tw, timer_entry_t *te);
+static void timer_unlink(timer_entry_t *te);
+static int timer_cascade(timer_wheel_t *tw, const int level, const int index);
+static timer_entry_t * timer_expire(timer_wheel_t *tw);
+static void * timer_worker(void *arg);
+
+
+void timer_entry_init(timer_entry_t *te, timer_func_t func, void *arg) {
+	te->next	= NULL;
+	te->prev	= NULL;
+	te->slot	= NULL;
+	te->expires	= 0;
+	te->func	= func;
+	te->arg		= arg;
+}
+
+timer_wheel_t * timer_wheel_create(const unsigned int tick_ms) {
+	timer_wheel_t *tw;
+	pthread_condattr_t cattr;
+
+	tw = (timer_wheel_t *)calloc(1, sizeof(timer_wheel_t));
+	if (!tw) {
+		return NULL;
+	}
+
+	tw->tick_ns 	= (uint64_t)(tick_ms ? tick_ms : 1) * 1000000;
+	tw->start_ns	= timer_now_ns();
+	tw->base	= 0;
+	tw->size	= 0;
+	tw->shutdown	= 0;
+
+	pthread_mutex_init(&tw->mutex, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tw->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&tw->thread, NULL, timer_worker, tw)) {
+		pthread_cond_destroy(&tw->cond);
+		pthread_mutex_destroy(&tw->mutex);
+		free(tw);
+		return NULL;
+	}
+
+	return tw;
+}
+
+void timer_wheel_destroy(timer_wheel_t *tw, timer_func_t discard_func) {
+	timer_entry_t *te;
+	int l, i;
+
+	if (!tw) {
+		return;
+	}
+
+	pthread_mutex_lock(&tw->mutex);
+	tw->shutdown = 1;
+	pthread_cond_signal(&tw->cond);
+	pthread_mutex_unlock(&tw->mutex);
+
+	pthread_join(tw->thread, NULL);
+
+	for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+			while ((te = tw->slots[l][i])) {
+				timer_unlink(te);
+				if (discard_func) {
+					discard_func(te->arg);
+				}
+			}
+		}
+	}
+
+	pthread_cond_destroy(&tw->cond);
+	pthread_mutex_destroy(&tw->mutex);
+	free(tw);
+}
+
+int timer_wheel_add(timer_wheel_t *tw, timer_entry_t *te, const unsigned int delay_ms) {
+	uint64_t now_ns;
+
+	pthread_mutex_lock(&tw->mutex);
+	if (te->slot || tw->shutdown) {
+		pthread_mutex_unlock(&tw->mutex);
+		return 0;
+	}
+
+	/* first tick boundary at or after the deadline, never early */
+	now_ns = timer_now_ns() - tw->start_ns;
+	te->expires = (now_ns + (uint64_t)delay_ms * 1000000 + tw->tick_ns - 1) / tw->tick_ns;
+	if (!tw->size) {
+		tw->base = now_ns / tw->tick_ns; // idle wheels do not tick
+	}
+	timer_place(tw, te);
+
+	if (!tw->size++) {
+		pthread_cond_signal(&tw->cond);
+	}
+	pthread_mutex_unlock(&tw->mutex);
+
+	return 1;
+}
+
+int timer_wheel_cancel(timer_wheel_t *tw, timer_entry_t *te) {
+	int ret = 0;
+
+	pthread_mutex_lock(&tw->mutex);
+	if (te->slot && te->slot != &tw->firing) {
+		timer_unlink(te);
+		tw->size--;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&tw->mutex);
+
+	return ret;
+}
+
+int timer_wheel_get_size(timer_wheel_t *tw) {
+	int size;
+
+	pthread_mutex_lock(&tw->mutex);
+	size = tw->size;
+	pthread_mutex_unlock(&tw->mutex);
+
+	return size;
+}
+
+static uint64_t timer_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t timer_now_tick(const timer_wheel_t *tw) {
+	return (timer_now_ns() - tw->start_ns) / tw->tick_ns;
+}
+
+/* level l holds the entries expiring within 64^(l+1) ticks of base */
+static void timer_place(timer_wheel_t *tw, timer_entry_t *te) {
+	uint64_t expires = te->expires;
+	uint64_t delta;
+	int l;
+
+	if (expires < tw->base) {
+		expires = tw->base; // late, expires on the next tick
+	}
+	delta = expires - tw->base;
+
+	for (l = 0; l < TIMER_WHEEL_LEVELS - 1; l++) {
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (l + 1)))) {
+			break;
+		}
+	}
+	if (l == TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+		expires = tw->base + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	}
+
+	te->slot = &tw->slots[l][(expires >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK];
+	te->prev = NULL;
+	if ((te->next = *te->slot)) {
+		te->next->prev = te;
+	}
+	*te->slot = te;
+}
+
+static void timer_unlink(timer_entry_t *te) {
+	if (te->prev) {
+		te->prev->next = te->next;
+	} else {
+		*te->slot = te->next;
+	}
+	if (te->next) {
+		te->next->prev = te->prev;
+	}
+	te->next = NULL;
+	te->prev = NULL;
+	te->slot = NULL;
+}
+
+/* moves the entries of a coarse slot one level down, returns index so
+ * that the caller goes on with the next level when it wrapped to 0 */
+static int timer_cascade(timer_wheel_t *tw, const int level, const int index) {
+	timer_entry_t *te, *next;
+
+	te = tw->slots[level][index];
+	tw->slots[level][index] = NULL;
+
+	for (; te; te = next) {
+		next = te->next;
+		timer_place(tw, te);
+	}
+
+	return index;
+}
+
+/* advances base by one tick, returns the expired entries, they can
+ * neither be armed nor cancelled until disarmed by the worker */
+static timer_entry_t * timer_expire(timer_wheel_t *tw) {
+	timer_entry_t *te, *list;
+	int l, index = tw->base & TIMER_WHEEL_MASK;
+
+	for (l = 1; !index && l < TIMER_WHEEL_LEVELS; l++) {
+		index = timer_cascade(tw, l, (tw->base >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK);
+	}
+
+	list = tw->slots[0][tw->base & TIMER_WHEEL_MASK];
+	tw->slots[0][tw->base & TIMER_WHEEL_MASK] = NULL;
+	tw->base++;
+
+	for (te = list; te; te = te->next) {
+		te->slot = &tw->firing;
+		tw->size--;
+	}
+
+	return list;
+}
+
+static void * timer_worker(void *arg) {
+	timer_wheel_t *tw = (timer_wheel_t *)arg;
+	timer_entry_t *te, *next, *fired;
+	struct timespec ts;
+	uint64_t deadline;
+
+	pthread_mutex_lock(&tw->mutex);
+	while (!tw->shutdown) {
+		if (!tw->size) {
+			pthread_cond_wait(&tw->cond, &tw->mutex);
+			continue;
+		}
+
+		if (tw->base > timer_now_tick(tw)) {
+			deadline = tw->start_ns + tw->base * tw->tick_ns;
+			ts.tv_sec  = deadline / 1000000000;
+			ts.tv_nsec = deadline % 1000000000;
+			pthread_cond_timedwait(&tw->cond, &tw->mutex, &ts);
+			continue;
+		}
+
+		fired = timer_expire(tw);
+		if (!fired) {
+			continue;
+		}
+
+		/* callbacks may arm their entry again, the lock is not held */
+		for (te = fired; te; te = next) {
+			next = te->next;
+			te->next = NULL;
+			te->prev = NULL;
+			te->slot = NULL;
+			pthread_mutex_unlock(&tw->mutex);
+			te->func(te->arg);
+			pthread_mutex_lock(&tw->mutex);
+		}
+	}
+	pthread_mutex_unlock(&tw->mutex);
+
+	return NULL;
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+
+#include "ws_deque.h"
+
+#define CACHE_LINE_SIZE		64
+
+typedef struct ws_deque_array {
+	long 			size;
+	struct ws_deque_array 	*retired;	// previous array, kept alive for thieves
+	void 			*buf[];
+} ws_deque_array_t;
+
+struct ws_deque {
+	long 			top;
+	char 			pad0[CACHE_LINE_SIZE - sizeof(long)];
+	long 			bottom;
+	char 			pad1[CACHE_LINE_SIZE - sizeof(long)];
+	ws_deque_array_t	*array;
+};
+
+static ws_deque_array_t * ws_deque_array_create(const long size);
+static ws_deque_array_t * ws_deque_grow(ws_deque_t *d, ws_deque_array_t *a, const long t, const long b);
+
+
+
+ws_deque_t * ws_deque_create(const unsigned int capacity) {
+	ws_deque_t *d;
+	long size = 2;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	if (posix_memalign((void **)&d, CACHE_LINE_SIZE, sizeof(ws_deque_t))) {
+		return NULL;
+	}
+
+	d->array = ws_deque_array_create(size);
+	if (!d->array) {
+		free(d);
+		return NULL;
+	}
+	d->top 		= 0;
+	d->bottom 	= 0;
+
+	return d;
+}
+
+void ws_deque_destroy(ws_deque_t *d) {
+	ws_deque_array_t *a1, *a2;
+
+	if (!d) {
+		return;
+	}
+
+	a1 = d->array;
+	while (a1) {
+		a2 = a1->retired;
+		free(a1);
+		a1 = a2;
+	}
+	free(d);
+}
+
+int ws_deque_push(ws_deque_t *d, void *data) {
+	ws_deque_array_t *a;
+	long b, t;
+
+	b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+	if (b - t > a->size - 1) {
+		a = ws_deque_grow(d, a, t, b);
+		if (!a) {
+			return 0;
+		}
+	}
+
+	__atomic_store_n(&a->buf[b & (a->size - 1)], data, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int ws_deque_pop(ws_deque_t *d, void **data) {
+	ws_deque_array_t *a;
+	long b, t;
+	int ret = WS_DEQUE_OK;
+
+	b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+	if (t <= b) {
+		*data = __atomic_load_n(&a->buf[b & (a->size - 1)], __ATOMIC_RELAXED);
+		if (t == b) {
+			/* last element, race against thieves */
+			if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+							 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				ret = WS_DEQUE_EMPTY;
+			}
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		ret = WS_DEQUE_EMPTY;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return ret;
+}
+
+int ws_deque_steal(ws_deque_t *d, void **data) {
+	ws_deque_array_t *a;
+	long b, t;
+
+	t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b) {
+		return WS_DEQUE_EMPTY;
+	}
+
+	a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+	*data = __atomic_load_n(&a->buf[t & (a->size - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return WS_DEQUE_ABORT;
+	}
+
+	return WS_DEQUE_OK;
+}
+
+static ws_deque_array_t * ws_deque_array_create(const long size) {
+	ws_deque_array_t *a;
+
+	a = (ws_deque_array_t *)malloc(sizeof(ws_deque_array_t) + sizeof(void *) * size);
+	if (!a) {
+		return NULL;
+	}
+	a->size 	= size;
+	a->retired 	= NULL;
+
+	return a;
+}
+
+static ws_deque_array_t * ws_deque_grow(ws_deque_t *d, ws_deque_array_t *a, const long t, const long b) {
+	ws_deque_array_t *na;
+	long i;
+
+	na = ws_deque_array_create(a->size << 1);
+	if (!na) {
+		return NULL;
+	}
+
+	for (i = t; i < b; i++) {
+		na->buf[i & (na->size - 1)] = __atomic_load_n(&a->buf[i & (a->size - 1)], __ATOMIC_RELAXED);
+	}
+	na->retired = a;
+	__atomic_store_n(&d->array, na, __ATOMIC_RELEASE);
+
+	return na;
+}